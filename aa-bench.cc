@@ -0,0 +1,321 @@
+// Benchmarks for aa's own bookkeeping: parsing AA files, loading rules and
+// planning the target graph, on synthetic AA files of 1k, 10k and 100k targets.
+//
+//   aa-bench [SIZE...]        Run the benchmarks (sizes default to 1000 10000
+//                             100000).
+//   aa-bench --generate SIZE  Print a synthetic AA file with SIZE targets.
+//
+// Built with aa.cc forced in (see the aa-bench rule in AA), so everything in
+// it is at hand.
+
+// Allocation counting.  Every operator new and delete in the program is
+// replaced here, plain, nothrow and aligned alike, so that each pointer is
+// freed by the allocator that made it.  They are kept out of line: inlined,
+// GCC pairs malloc() with operator delete and warns (-Wmismatched-new-delete).
+static uint64_t allocated_bytes = 0;
+static uint64_t allocations = 0;
+
+namespace {
+__attribute__((noinline)) void* countedAlloc(size_t size, size_t align) {
+  allocated_bytes += size;
+  ++allocations;
+  void* p = nullptr;
+  if (size == 0) {
+    size = 1;
+  }
+  if (align <= alignof(std::max_align_t)) {
+    p = malloc(size);
+  } else if (posix_memalign(&p, align, size) != 0) {
+    p = nullptr;
+  }
+  return p;
+}
+
+__attribute__((noinline)) void* countedNew(size_t size, size_t align) {
+  void* p = countedAlloc(size, align);
+  if (p == nullptr) {
+    abort();  // No exceptions to throw std::bad_alloc with.
+  }
+  return p;
+}
+
+__attribute__((noinline)) void countedFree(void* p) noexcept { free(p); }
+} // ::
+
+void* operator new(size_t size) {
+  return countedNew(size, 0);
+}
+void* operator new[](size_t size) {
+  return countedNew(size, 0);
+}
+void* operator new(size_t size, std::align_val_t align) {
+  return countedNew(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align) {
+  return countedNew(size, static_cast<size_t>(align));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return countedAlloc(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return countedAlloc(size, 0);
+}
+void* operator new(size_t size, std::align_val_t align,
+                   const std::nothrow_t&) noexcept {
+  return countedAlloc(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t&) noexcept {
+  return countedAlloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  countedFree(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  countedFree(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  countedFree(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  countedFree(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  countedFree(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  countedFree(p);
+}
+
+// xorshift64*; deterministic so that runs compare.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed | 1) {}
+  uint64_t Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545F4914F6CDD1DULL;
+  }
+  // Uniform in [0, n).
+  size_t Below(size_t n) { return static_cast<size_t>(Next() % n); }
+  // In [0, 1).
+  double Unit() { return static_cast<double>(Next() >> 11) * 0x1p-53; }
+
+ private:
+  uint64_t state_;
+};
+
+string targetName(size_t i) {
+  return "t" + std::to_string(i) + ".m" + std::to_string(i / 64);
+}
+
+// An AA file of `num_targets' targets in the shape of a large monorepo: a
+// module attribute map of compiler flags, mostly c++lib targets with a c++bin
+// every tenth, each with a few sources, headers, forced includes and flags.
+// Targets only depend on earlier ones.  Each has up to 8 dependencies, picked
+// with a strong bias towards the first targets, so a few base libraries get
+// a fan-in in the thousands while most get a handful.
+string SyntheticAa(size_t num_targets, uint64_t seed = 1) {
+  Random random(seed);
+  string s = "{:cflags-default [\"-O2\"";
+  for (size_t i = 0; i < 40; ++i) {
+    s += " \"-W" + std::to_string(i) + "\"";
+  }
+  s += "]\n :lflags-default [\"-flto\" \"-pipe\"]\n";
+  for (size_t i = 0; i < 20; ++i) {
+    s += " :param" + std::to_string(i) + " \"value " + std::to_string(i) +
+         "\"\n";
+  }
+  s += "}\n\n";
+  for (size_t i = 0; i < num_targets; ++i) {
+    const string name = targetName(i);
+    const string dir = "m" + std::to_string(i / 64) + "/t" + std::to_string(i);
+    const bool binary = i % 10 == 9;
+    s += name + (binary ? " (c++bin [" : " (c++lib [");
+    if (i > 0) {
+      const size_t num_deps = std::min(i, random.Below(9));
+      set<size_t> deps;
+      for (size_t k = 0; k < num_deps; ++k) {
+        const double r = random.Unit();
+        deps.insert(static_cast<size_t>(static_cast<double>(i) * r * r * r));
+      }
+      string sep = "";
+      for (size_t dep : deps) {
+        s += sep + targetName(dep);
+        sep = " ";
+      }
+    }
+    s += "]\n  {";
+    if (!binary) {
+      s += ":hdr [";
+      for (size_t k = 0; k < 3; ++k) {
+        s += (k == 0 ? "\"" : " \"") + dir + "/h" + std::to_string(k) + ".h\"";
+      }
+      s += "]\n   ";
+    }
+    s += ":src [";
+    for (size_t k = 0, n = 1 + random.Below(5); k < n; ++k) {
+      s += (k == 0 ? "\"" : " \"") + dir + "/s" + std::to_string(k) + ".cc\"";
+    }
+    s += "]\n   :inc [\"string\" \"vector\" \"map\" \"memory\"]\n"
+         "   :cflags [\"-DTARGET=" + std::to_string(i) +
+         "\" \"-I\" \"" + dir + "/include\"]\n"
+         "   :lib [\"stdc++\"]})\n";
+  }
+  return s;
+}
+
+// Runs `op' until at least kMinMicros have passed in it and prints the mean
+// time, allocated bytes and number of allocations per call.  `setup' runs
+// before every call, and counts for neither.
+const int64_t kMinMicros = 300000;
+
+template <typename Setup, typename Op>
+void bench(const string& name, size_t size, Setup setup, Op op) {
+  size_t iterations = 0;
+  uint64_t bytes = 0;
+  uint64_t count = 0;
+  int64_t elapsed_us = 0;
+  do {
+    setup(iterations);
+    const uint64_t bytes_before = allocated_bytes;
+    const uint64_t allocations_before = allocations;
+    const int64_t begin_us = os::NowMicros();
+    op(iterations);
+    elapsed_us += os::NowMicros() - begin_us;
+    bytes += allocated_bytes - bytes_before;
+    count += allocations - allocations_before;
+    ++iterations;
+  } while (elapsed_us < kMinMicros);
+  printf("%-28s %7zu %10zu %16.0f ns/op %14.0f B/op %12.0f allocs/op\n",
+         name.c_str(), size, iterations,
+         static_cast<double>(elapsed_us) * 1e3 /
+             static_cast<double>(iterations),
+         static_cast<double>(bytes) / static_cast<double>(iterations),
+         static_cast<double>(count) / static_cast<double>(iterations));
+  fflush(stdout);
+}
+
+template <typename Op>
+void bench(const string& name, size_t size, Op op) {
+  bench(name, size, [](size_t) {}, op);
+}
+
+// Reaches into the Manager for the benchmarks of its private parts.
+class ManagerBenchmark {
+ public:
+  static void Run(size_t size) {
+    const string aa = SyntheticAa(size);
+    const eden::Tree defaults = eden::read(
+        "{:compiler \"c++\" :linker \"c++\" :out-dir \"./.out/\""
+        " :bin-dir \"./.bin/\"}");
+    const eden::Tree root = eden::read(aa);
+
+    bench("eden::read", size, [&](size_t) { eden::read(aa); });
+    bench("eden::Reader (64k chunks)", size, [&](size_t) {
+      eden::Reader reader([](eden::Tree) {});
+      for (size_t i = 0; i < aa.size(); i += 1 << 16) {
+        reader.Feed(std::string_view(aa).substr(i, 1 << 16));
+      }
+      reader.Finish();
+    });
+    bench("eden::IndexForms", size, [&](size_t) {
+      vector<std::string_view> forms;
+      string err;
+      eden::IndexForms(aa, &forms, &err);
+    });
+    bench("eden::pprint", size, [&](size_t) { eden::pprint(*root); });
+    string text;
+    bench("eden::Writer (pretty)", size, [&](size_t) {
+      text.clear();
+      eden::Writer(&text, eden::Writer::Style::Pretty).Write(*root);
+    });
+    bench("eden::Writer (compact)", size, [&](size_t) {
+      text.clear();
+      eden::Writer(&text, eden::Writer::Style::Compact).Write(*root);
+    });
+    const string encoded = eden::encode(*root);
+    bench("eden::encode", size, [&](size_t) { eden::encode(*root); });
+    bench("eden::decode", size, [&](size_t) {
+      eden::decode(encoded.data(), encoded.size());
+    });
+    bench("Manager::Read", size, [&](size_t) {
+      Manager manager(*defaults);
+      if (error err = manager.Read(*root); err != "") {
+        std::cerr << err << "\n";
+        exit(1);
+      }
+    });
+    bench("Manager::Index", size, [&](size_t) {
+      Manager manager(*defaults);
+      manager.Index(aa);
+    });
+    // The closures of the last targets, which depend on the most.
+    bench("Manager::Index + Load", size, [&](size_t i) {
+      Manager manager(*defaults);
+      manager.Index(aa);
+      manager.Load({targetName(size - 1 - i % 100)});
+    });
+
+    // The first 100 rules, each time on a fresh Manager made outside the
+    // timed region; on one Manager, the rules and PCH groups of earlier
+    // calls would pile up.
+    const eden::Nodes& forms = root->AsNodes();
+    const size_t batch = std::min<size_t>(100, (forms.size() - 1) / 2);
+    unique_ptr<Manager> fresh;
+    bench(
+        "Manager::processRule x100", size,
+        [&](size_t) { fresh = std::make_unique<Manager>(*defaults); },
+        [&](size_t) {
+          for (size_t form = 1; form < 1 + 2 * batch; form += 2) {
+            fresh->processRule(string(forms[form]->AsString()),
+                               *forms[form + 1]);
+          }
+        });
+
+    Manager manager(*defaults);
+    manager.Read(*root);
+    map<string, set<string>> dependencies;
+    set<string> targets;
+    for (const auto& kv : manager.rules_) {
+      const vector<string>& deps = kv.second->Deps();
+      dependencies[kv.first].insert(deps.begin(), deps.end());
+      targets.insert(kv.first);
+    }
+    bench("buildTargetGraph", size, [&](size_t) {
+      buildTargetGraph(targets, dependencies);
+    });
+  }
+};
+
+int main(int argc, char* argv[], char** envp) {
+  os::Runtime runtime(argc, argv, envp);
+  const vector<string>& args = runtime.args();
+  if (args.size() == 2 && args[0] == "--generate") {
+    std::cout << SyntheticAa(strtoull(args[1].c_str(), nullptr, 10));
+    return 0;
+  }
+  vector<size_t> sizes;
+  for (const string& arg : args) {
+    sizes.push_back(strtoull(arg.c_str(), nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = {1000, 10000, 100000};
+  }
+  printf("%-28s %7s %10s %22s %19s %22s\n", "benchmark", "targets",
+         "iterations", "time", "allocated", "allocations");
+  for (size_t size : sizes) {
+    ManagerBenchmark::Run(size);
+  }
+  return 0;
+}
@@ -0,0 +1,755 @@
+// Tests of aa's build machinery, each in a scratch directory of its own.
+// Built with aa.cc forced in (see the aa-test rule in AA).
+
+class ScratchDir {
+ public:
+  ScratchDir() {
+    char cwd[PATH_MAX];
+    old_dir_ = getcwd(cwd, sizeof(cwd));
+    char dir[] = "/tmp/aa-test.XXXXXX";
+    dir_ = mkdtemp(dir);
+    chdir(dir_.c_str());
+  }
+  ~ScratchDir() {
+    chdir(old_dir_.c_str());
+    os::ForkExecWait("/bin/rm", {"-rf", dir_});
+  }
+
+ private:
+  string old_dir_;
+  string dir_;
+};
+
+// Creates `path' if needed and sets its mtime to `seconds' after the epoch.
+void touch(const string& path, time_t seconds) {
+  close(open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+  const struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+  utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+// Creates `path', and the directories it is in, with `contents'.
+void write(const string& path, const string& contents) {
+  ASSERT_EQ("", path::MakeContainingDir(path));
+  std::ofstream(path) << contents;
+}
+
+Action shellAction(const string& script, const string& output = "") {
+  Action action;
+  action.kind = "compiling";
+  action.message = "[" + script + "]";
+  action.program = "/bin/sh";
+  action.args = {"-c", script};
+  if (!output.empty()) {
+    action.outputs = {output};
+  }
+  return action;
+}
+
+// Hands out the same actions every time it is resolved, and counts how
+// often that is.
+class FakeResolver : public Resolver {
+ public:
+  FakeResolver(vector<Action> actions, vector<string> deps = {})
+      : actions_(std::move(actions)), deps_(std::move(deps)) {}
+  const vector<string>& Deps() override { return deps_; }
+  error Resolve(const string& target, vector<Action>* actions) override {
+    if (++resolved > 3) {
+      return "resolved again";  // Ends a build that would otherwise loop.
+    }
+    *actions = actions_;
+    return "";
+  }
+  vector<string> Objects(const string& target) override { return objects; }
+
+  size_t resolved = 0;
+  vector<string> objects;
+
+ private:
+  const vector<Action> actions_;
+  const vector<string> deps_;
+};
+
+typedef map<string, unique_ptr<Resolver>> FakeRules;
+
+// Builds `targets' with `jobs' jobs, the way Manager::Resolve does.
+error build(const set<string>& targets, size_t jobs, const FakeRules& rules,
+            ObjectStore* store = nullptr) {
+  map<string, set<string>> dependencies;
+  for (const auto& kv : rules) {
+    const vector<string>& deps = kv.second->Deps();
+    dependencies[kv.first].insert(deps.begin(), deps.end());
+  }
+  auto graph = buildTargetGraph(targets, dependencies);
+  if (graph.first != "") {
+    return graph.first;
+  }
+  BuildState state;
+  if (error err = state.log.Open("./.out/.aa_log"); err != "") {
+    return err;
+  }
+  if (error err = state.deps_log.Open("./.out/.aa_deps"); err != "") {
+    return err;
+  }
+  return Executor(jobs, std::move(graph.second), rules, &state, store).Run();
+}
+
+// upToDate() as at the start of a build, with no mtimes cached.
+bool upToDate(const Action& action, uint64_t fingerprint, const BuildLog& log,
+              const DepsLog& deps_log) {
+  FileStates files;
+  return upToDate(action, fingerprint, log, deps_log, &files);
+}
+
+TEST(BuildTargetGraph, Priority) {
+  const auto graph = buildTargetGraph(
+      {"a"}, {{"a", {"b", "d"}}, {"b", {"c"}}, {"c", {}}, {"d", {}},
+              {"unused", {"a"}}});
+  ASSERT_EQ("", graph.first);
+  EXPECT_EQ((vector<string>{"a", "b", "c", "d"}), graph.second.names);
+  EXPECT_EQ((vector<size_t>{1, 2, 3, 2}), graph.second.priority);
+  EXPECT_EQ((vector<size_t>{2, 1, 0, 0}), graph.second.pending_deps);
+  EXPECT_EQ((vector<size_t>{1}), graph.second.rdepends[2]);
+  EXPECT_EQ((vector<size_t>{0}), graph.second.rdepends[3]);
+}
+
+TEST(BuildTargetGraph, Errors) {
+  EXPECT_EQ("Dependency cycle through a and b",
+            buildTargetGraph({"a"}, {{"a", {"b"}}, {"b", {"a"}}}).first);
+  EXPECT_EQ("Dependency cycle through c and c",
+            buildTargetGraph({"c"}, {{"c", {"c"}}}).first);
+  EXPECT_EQ("Couldn't find node x in rules.",
+            buildTargetGraph({"a"}, {{"a", {"x"}}}).first);
+  EXPECT_EQ("Couldn't find node y in rules.",
+            buildTargetGraph({"y"}, {}).first);
+}
+
+TEST(Executor, RunsTheActionsOfATargetInOrder) {
+  ScratchDir scratch;
+  FakeRules rules;
+  Action b = shellAction("echo b >> log");
+  b.stage = 1;
+  rules["t"].reset(new FakeResolver({shellAction("echo a >> log"), b}));
+  EXPECT_EQ("", build({"t"}, 4, rules));
+  EXPECT_EQ("a\nb\n", strings::ReadFileToString("log"));
+}
+
+// With one job, the ready target heading the longest chain goes first.
+TEST(Executor, StartsTheLongestChainFirst) {
+  ScratchDir scratch;
+  FakeRules rules;
+  for (const string target : {"a", "b", "c", "z"}) {
+    const vector<string> deps = target == "a"   ? vector<string>{"b"}
+                                : target == "b" ? vector<string>{"c"}
+                                                : vector<string>{};
+    rules[target].reset(
+        new FakeResolver({shellAction("echo " + target + " >> log")}, deps));
+  }
+  EXPECT_EQ("", build({"a", "z"}, 1, rules));
+  EXPECT_EQ("c\nb\na\nz\n", strings::ReadFileToString("log"));
+}
+
+TEST(Executor, KeepsAtMostJobsRunning) {
+  ScratchDir scratch;
+  FakeRules rules;
+  set<string> targets;
+  for (int i = 0; i < 6; ++i) {
+    const string mark = "r" + std::to_string(i);
+    rules[mark].reset(new FakeResolver({shellAction(
+        "touch " + mark + "; ls r* | wc -l >> counts; sleep 0.05; rm " +
+        mark)}));
+    targets.insert(mark);
+  }
+  EXPECT_EQ("", build(targets, 2, rules));
+  const string counts = strings::ReadFileToString("counts");
+  EXPECT_EQ(6, std::count(counts.begin(), counts.end(), '\n'));
+  for (char c : counts) {
+    EXPECT_TRUE(c == '\n' || c == ' ' || c == '1' || c == '2') << counts;
+  }
+}
+
+TEST(Executor, FailureSkipsDependents) {
+  ScratchDir scratch;
+  FakeRules rules;
+  rules["bad"].reset(
+      new FakeResolver({shellAction("exit 3"), shellAction("touch never")}));
+  rules["dependent"].reset(
+      new FakeResolver({shellAction("touch never")}, {"bad"}));
+  rules["good"].reset(new FakeResolver({shellAction("touch ok")}));
+  EXPECT_EQ("[target=bad] [compiling] program /bin/sh returned with status "
+            "768\n"
+            "[target=dependent] skipped, dependency bad failed\n",
+            build({"dependent", "good"}, 1, rules));
+  EXPECT_NE(0, access("never", F_OK));
+  EXPECT_EQ(0, access("ok", F_OK));
+}
+
+TEST(Executor, SkipsUpToDateActions) {
+  ScratchDir scratch;
+  FakeRules rules;
+  rules["t"].reset(new FakeResolver(
+      {shellAction("echo ran >> log; touch out", "out")}));
+  EXPECT_EQ("", build({"t"}, 1, rules));
+  EXPECT_EQ("", build({"t"}, 1, rules));
+  EXPECT_EQ("ran\n", strings::ReadFileToString("log"));
+}
+
+// Rebuilds when a header the depfile reported changes, and only then.
+TEST(Executor, FollowsDepfiles) {
+  ScratchDir scratch;
+  FakeRules rules;
+  Action action = shellAction(
+      "echo ran >> log; touch out; echo 'out: in.h' > out.d", "out");
+  action.depfile = "out.d";
+  rules["t"].reset(new FakeResolver({action}));
+  touch("in.h", 100);
+  EXPECT_EQ("", build({"t"}, 1, rules));
+  EXPECT_EQ("", build({"t"}, 1, rules));
+  EXPECT_EQ("ran\n", strings::ReadFileToString("log"));
+  touch("in.h", time(nullptr) + 10);
+  EXPECT_EQ("", build({"t"}, 1, rules));
+  EXPECT_EQ("ran\nran\n", strings::ReadFileToString("log"));
+}
+
+// A checkout that has never built anything gets its outputs from the store.
+TEST(Executor, FetchesFromTheStore) {
+  ScratchDir scratch;
+  char cwd[PATH_MAX];
+  ObjectStore store(string(getcwd(cwd, sizeof(cwd))) + "/cache/", 0);
+  Action action = shellAction(
+      "echo ran >> ../log; mkdir -p out; cp in.cc out/in.o", "out/in.o");
+  action.inputs = {"in.cc"};
+  action.cacheable = true;
+  FakeRules rules;
+  rules["t"].reset(new FakeResolver({action}));
+  for (const string checkout : {"one/", "two/"}) {
+    write(checkout + "in.cc", "int x;\n");
+    chdir(checkout.c_str());
+    EXPECT_EQ("", build({"t"}, 1, rules, &store));
+    EXPECT_EQ("int x;\n", strings::ReadFileToString("out/in.o"));
+    chdir("..");
+  }
+  EXPECT_EQ("ran\n", strings::ReadFileToString("log"));
+}
+
+TEST(ObjectStore, SharedAcrossCheckouts) {
+  ScratchDir scratch;
+  char cwd[PATH_MAX];
+  ObjectStore store(string(getcwd(cwd, sizeof(cwd))) + "/cache/", 0);
+  Action action = shellAction("echo object > a.o", "a.o");
+  action.inputs = {"a.cc"};
+  action.depfile = "a.d";
+  action.cacheable = true;
+  for (const string checkout : {"one/", "two/"}) {
+    write(checkout + "a.cc", "#include \"a.h\"\n");
+    write(checkout + "a.h", "int a;\n");
+  }
+  chdir("one");
+  DepsLog one;
+  EXPECT_FALSE(store.Fetch(action, 1, &one));
+  write("a.o", "object\n");
+  one.Record("a.o", {"a.cc", "a.h"});
+  store.Insert(action, 1, one);
+
+  touch("a.o", 1);  // A hard link to the blob now.
+
+  chdir("../two");
+  DepsLog two;
+  EXPECT_TRUE(store.Fetch(action, 1, &two));
+  EXPECT_EQ("object\n", strings::ReadFileToString("a.o"));
+  // Touched, but not through the blob into the other checkout.
+  EXPECT_LT(1000000000, os::ModTime("a.o"));
+  EXPECT_EQ(1000000000, os::ModTime("../one/a.o"));
+  const vector<uint32_t>* deps = two.Deps("a.o");
+  ASSERT_NE(nullptr, deps);
+  ASSERT_EQ(2u, deps->size());
+  EXPECT_EQ("a.h", two.Path((*deps)[1]));
+  EXPECT_FALSE(store.Fetch(action, 2, &two));  // Another command line.
+  write("a.h", "int b;\n");
+  EXPECT_FALSE(store.Fetch(action, 1, &two));
+  chdir("..");
+}
+
+TEST(ObjectStore, CountsUncacheableActionsApart) {
+  ScratchDir scratch;
+  ObjectStore store("./cache/", 0);
+  DepsLog deps_log;
+  Action action = shellAction("touch a.o", "a.o");
+  EXPECT_FALSE(store.Fetch(action, 1, &deps_log));
+  action.cacheable = true;
+  action.depfile = "a.d";  // No manifest for it yet.
+  EXPECT_FALSE(store.Fetch(action, 1, &deps_log));
+  EXPECT_EQ("cache: 0 hits, 1 misses, 1 uncacheable, 0 evicted (0 MiB)\n",
+            store.FinishAndSummarize());
+}
+
+TEST(ObjectStore, EvictsDownToTheBudget) {
+  ScratchDir scratch;
+  DepsLog deps_log;
+  vector<Action> actions;
+  {
+    ObjectStore store("./cache/", 100);
+    for (const string name : {"a", "b"}) {
+      Action action = shellAction("touch " + name + ".o", name + ".o");
+      action.cacheable = true;
+      write(name + ".o", string(60, 'x'));
+      store.Insert(action, actions.size(), deps_log);
+      actions.push_back(action);
+    }
+    store.StartEviction();
+    EXPECT_EQ("cache: 0 hits, 0 misses, 0 uncacheable, 1 evicted (0 MiB)\n",
+              store.FinishAndSummarize());
+  }
+  ObjectStore store("./cache/", 100);
+  EXPECT_NE(store.Fetch(actions[0], 0, &deps_log),
+            store.Fetch(actions[1], 1, &deps_log));
+  store.StartEviction();  // What is left fits.
+  EXPECT_EQ("cache: 1 hits, 1 misses, 0 uncacheable, 0 evicted (0 MiB)\n",
+            store.FinishAndSummarize());
+}
+
+TEST(ObjectStore, EvictsOnlyWhenItMayBeOverTheBudget) {
+  ScratchDir scratch;
+  DepsLog deps_log;
+  ObjectStore store("./cache/", 100);
+  uint64_t fingerprint = 0;
+  const auto insert = [&](const string& name, size_t size) {
+    Action action = shellAction("touch " + name + ".o", name + ".o");
+    action.cacheable = true;
+    write(name + ".o", string(size, 'x'));
+    store.Insert(action, fingerprint++, deps_log);
+  };
+  insert("a", 60);
+  store.StartEviction();  // The first pass.
+  EXPECT_EQ("", store.FinishAndSummarize());
+  // Passes leave their mark; see that one does not run while 60 + 30 bytes
+  // fit, but does once another 30 do not.
+  touch("cache/evicted", 0);
+  insert("b", 30);
+  store.StartEviction();
+  EXPECT_EQ("", store.FinishAndSummarize());
+  EXPECT_EQ(0, os::ModTime("cache/evicted"));
+  insert("c", 30);
+  store.StartEviction();
+  EXPECT_EQ("cache: 0 hits, 0 misses, 0 uncacheable, 1 evicted (0 MiB)\n",
+            store.FinishAndSummarize());
+  EXPECT_NE(0, os::ModTime("cache/evicted"));
+}
+
+// The actions of one stage run in parallel, and the next stage only starts
+// once they are all done.
+TEST(Executor, RunsStagesInOrder) {
+  ScratchDir scratch;
+  vector<Action> actions;
+  for (const string name : {"a", "b", "c"}) {
+    actions.push_back(
+        shellAction("touch " + name + ".started; sleep 0.1; touch " + name +
+                        ".o; ls *.started | wc -l > " + name + ".seen",
+                    name + ".o"));
+  }
+  Action link = shellAction("cat a.o b.o c.o > bin", "bin");
+  link.stage = 1;
+  actions.push_back(link);
+  FakeRules rules;
+  rules["t"].reset(new FakeResolver(actions));
+  EXPECT_EQ("", build({"t"}, 3, rules));
+  EXPECT_EQ(0, access("bin", F_OK));
+  EXPECT_EQ("3\n", strings::ReadFileToString("a.seen"));
+}
+
+// With -j 1, the actions after a failing one never start, and the target is
+// not retried.
+TEST(Executor, FailingFirstAction) {
+  for (size_t jobs : {1, 2}) {
+    ScratchDir scratch;
+    FakeRules rules;
+    auto* resolver = new FakeResolver(
+        {shellAction("exit 1", "a.o"), shellAction("touch b.o", "b.o"),
+         shellAction("touch c.o", "c.o")});
+    rules["t"].reset(resolver);
+    const error err = build({"t"}, jobs, rules);
+    EXPECT_EQ(1u, resolver->resolved) << "-j " << jobs;
+    EXPECT_EQ(0u, err.find("[target=t] [compiling]")) << err;
+    EXPECT_EQ(string::npos, err.find("\n[target=t]")) << err;
+    if (jobs == 1) {
+      EXPECT_NE(0, access("b.o", F_OK));
+    }
+  }
+}
+
+TEST(BuildLog, OpensWithoutOutDir) {
+  ScratchDir scratch;
+  {
+    BuildLog log;
+    ASSERT_EQ("", log.Open("./.out/.aa_log"));
+    log.Record("./.out/a.o", 42);
+  }
+  BuildLog log;
+  ASSERT_EQ("", log.Open("./.out/.aa_log"));
+  EXPECT_TRUE(log.Matches("./.out/a.o", 42));
+  EXPECT_FALSE(log.Matches("./.out/a.o", 43));
+}
+
+vector<string> depfileDeps(string contents) {
+  vector<std::string_view> deps;
+  if (error err = parseDepfile(&contents, &deps); err != "") {
+    return {err};
+  }
+  return vector<string>(deps.begin(), deps.end());
+}
+
+TEST(ParseDepfile, Paths) {
+  EXPECT_EQ((vector<string>{"src.cc", "some dir/a.h", "b.h"}),
+            depfileDeps("out.o: src.cc some\\ dir/a.h b.h\n"));
+  EXPECT_EQ((vector<string>{"a.cc", "b.h", "c.h", "$x#"}),
+            depfileDeps("out.o: a.cc \\\n  b.h \\\r\n\tc.h $$x\\#\n"));
+  // Several targets, and the phony targets of -MP.
+  EXPECT_EQ((vector<string>{"a.cc", "b.h"}),
+            depfileDeps("out.o out.d : a.cc b.h\n\nb.h:\n"));
+  EXPECT_EQ((vector<string>{"no target in depfile"}),
+            depfileDeps("a.cc b.h\n"));
+  EXPECT_EQ((vector<string>{}), depfileDeps("out.o:\n"));
+}
+
+TEST(DepsLog, OpensWithoutOutDir) {
+  ScratchDir scratch;
+  {
+    DepsLog log;
+    ASSERT_EQ("", log.Open("./.out/.aa_deps"));
+    log.Record("./.out/a.o", {"a.cc", "a.h"});
+    log.Record("./.out/b.o", {"b.cc", "a.h"});
+    log.Record("./.out/a.o", {"a.cc"});
+  }
+  DepsLog log;
+  ASSERT_EQ("", log.Open("./.out/.aa_deps"));
+  EXPECT_EQ(nullptr, log.Deps("./.out/c.o"));
+  const vector<uint32_t>* deps = log.Deps("./.out/b.o");
+  ASSERT_NE(nullptr, deps);
+  ASSERT_EQ(2u, deps->size());
+  EXPECT_EQ("a.h", log.Path((*deps)[1]));
+  deps = log.Deps("./.out/a.o");
+  ASSERT_NE(nullptr, deps);
+  ASSERT_EQ(1u, deps->size());
+  EXPECT_EQ("a.cc", log.Path((*deps)[0]));
+}
+
+TEST(UpToDate, MtimesAndFingerprints) {
+  ScratchDir scratch;
+  BuildLog log;
+  ASSERT_EQ("", log.Open("./.out/.aa_log"));
+  const DepsLog deps_log;
+  Action action = shellAction("true", "out");
+  action.inputs = {"in"};
+  touch("in", 100);
+  touch("out", 200);
+  const uint64_t fingerprint = BuildLog::Fingerprint(action);
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));  // Never built.
+  log.Record("out", fingerprint);
+  EXPECT_TRUE(upToDate(action, fingerprint, log, deps_log));
+  touch("in", 200);
+  EXPECT_TRUE(upToDate(action, fingerprint, log, deps_log));
+
+  Action changed = action;
+  changed.args.push_back("-O2");
+  EXPECT_NE(fingerprint, BuildLog::Fingerprint(changed));
+  EXPECT_FALSE(upToDate(changed, BuildLog::Fingerprint(changed), log,
+                        deps_log));
+  touch("in", 300);
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));
+  touch("in", 100);
+  unlink("out");
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));
+  touch("out", 200);
+  unlink("in");
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));
+}
+
+TEST(UpToDate, DiscoveredInputs) {
+  ScratchDir scratch;
+  BuildLog log;
+  ASSERT_EQ("", log.Open("./.out/.aa_log"));
+  DepsLog deps_log;
+  Action action = shellAction("true", "out");
+  action.depfile = "out.d";
+  touch("in.h", 100);
+  touch("out", 200);
+  const uint64_t fingerprint = BuildLog::Fingerprint(action);
+  log.Record("out", fingerprint);
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));  // No deps yet.
+  deps_log.Record("out", {"in.h"});
+  EXPECT_TRUE(upToDate(action, fingerprint, log, deps_log));
+  touch("in.h", 300);
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));
+  unlink("in.h");
+  EXPECT_FALSE(upToDate(action, fingerprint, log, deps_log));
+}
+
+TEST(ParseOptions, Jobs) {
+  Options options;
+  EXPECT_EQ("", ParseOptions({"-j", "3", "x", "-j5"}, &options));
+  EXPECT_EQ(5u, options.jobs);
+  EXPECT_EQ(vector<string>{"x"}, options.targets);
+  EXPECT_EQ("invalid value for -j: 0", ParseOptions({"-j0"}, &options));
+  EXPECT_EQ("-j requires a number", ParseOptions({"x", "-j"}, &options));
+}
+
+// Waits for all the children of `spawner', by pid.
+map<pid_t, os::Spawner::Finished> waitAll(os::Spawner* spawner) {
+  map<pid_t, os::Spawner::Finished> by_pid;
+  while (spawner->size() > 0) {
+    vector<os::Spawner::Finished> finished;
+    spawner->Wait(-1, &finished);
+    for (os::Spawner::Finished& f : finished) {
+      by_pid.emplace(f.pid, std::move(f));
+    }
+  }
+  return by_pid;
+}
+
+TEST(Spawner, CapturesOutputAndStatus) {
+  os::Spawner spawner;
+  const pid_t a =
+      spawner.Start("/bin/sh", {"-c", "echo out; echo err >&2; exit 3"});
+  // More than a pipe holds, so it only finishes if Wait() reads as it goes.
+  const pid_t b = spawner.Start("/bin/sh", {"-c", "head -c 300000 /dev/zero"});
+  const pid_t c = spawner.Start("/nonexistent", {});
+  ASSERT_NE(-1, a);
+  ASSERT_NE(-1, b);
+  map<pid_t, os::Spawner::Finished> finished = waitAll(&spawner);
+  ASSERT_EQ(c == -1 ? 2u : 3u, finished.size());
+  EXPECT_EQ("out\nerr\n", finished[a].output);
+  EXPECT_EQ("program /bin/sh returned with status 768",
+            os::StatusError("/bin/sh", finished[a].status));
+  EXPECT_EQ(300000u, finished[b].output.size());
+  EXPECT_EQ("", os::StatusError("/bin/sh", finished[b].status));
+  if (c != -1) {
+    EXPECT_NE("", os::StatusError("/nonexistent", finished[c].status));
+  }
+}
+
+TEST(ForkExecWait, ReportsAChildItCouldNotWaitFor) {
+  EXPECT_EQ("", os::ForkExecWait("/bin/true", {}));
+  // With SIGCHLD ignored, the kernel reaps children itself.
+  signal(SIGCHLD, SIG_IGN);
+  EXPECT_EQ("could not wait for /bin/true", os::ForkExecWait("/bin/true", {}));
+  signal(SIGCHLD, SIG_DFL);
+  EXPECT_EQ("program /bin/false returned with status 256",
+            os::ForkExecWait("/bin/false", {}));
+}
+
+TEST(Spawner, WakesUpForWatchedFds) {
+  os::Spawner spawner;
+  int fds[2];
+  ASSERT_EQ(0, pipe2(fds, O_CLOEXEC));
+  spawner.Watch(fds[0]);
+  vector<os::Spawner::Finished> finished;
+  EXPECT_FALSE(spawner.Wait(0, &finished));
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  EXPECT_TRUE(spawner.Wait(-1, &finished));
+  EXPECT_TRUE(finished.empty());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Every target's objects come once, before those of the targets it depends
+// on.
+TEST(LinkClosure, LinkOrder) {
+  const map<string, vector<string>> deps = {
+      {"bin", {"app", "util", "pch"}},
+      {"app", {"base", "util"}},
+      {"util", {"base"}},
+      {"base", {}},
+      {"pch", {}}};
+  Rules rules;
+  for (const auto& kv : deps) {
+    auto* resolver = new FakeResolver({}, kv.second);
+    if (kv.first != "pch") {
+      resolver->objects = {kv.first + ".o"};
+    }
+    rules[kv.first].reset(resolver);
+  }
+  LinkClosure closure(&rules);
+  EXPECT_EQ(vector<string>({"app.o", "util.o", "base.o"}),
+            closure.Objects("bin"));
+  EXPECT_EQ(vector<string>({"util.o", "base.o"}), closure.Objects("app"));
+  EXPECT_EQ(vector<string>(), closure.Objects("base"));
+}
+
+// The batches as "unity file: sources...", which only stay the same if both
+// do.
+set<string> describe(const vector<CompileUnit>& units) {
+  set<string> batches;
+  for (const CompileUnit& unit : units) {
+    batches.insert(unit.unity + ":" + strings::Join(unit.srcs, " "));
+  }
+  return batches;
+}
+
+// Adding or removing a source changes the batch it is in and at most one
+// other.
+TEST(CppCompileUnits, UnityBatchesAreStable) {
+  Attrs no_unity;
+  no_unity.Set(":out-dir", eden::Node::String(".out/"));
+  Attrs attrs = no_unity;
+  attrs.Set(":unity-batch-size", eden::Node::Int(4));
+  vector<string> srcs;
+  for (int i = 0; i < 100; ++i) {
+    srcs.push_back("src" + std::to_string(i) + ".cc");
+  }
+  const set<string> all = describe(cppCompileUnits("t", srcs, attrs));
+  EXPECT_LT(10u, all.size());
+  for (size_t i = 0; i < srcs.size(); ++i) {
+    vector<string> fewer = srcs;
+    fewer.erase(fewer.begin() + static_cast<ptrdiff_t>(i));
+    const set<string> batches = describe(cppCompileUnits("t", fewer, attrs));
+    vector<string> changed;
+    std::set_symmetric_difference(all.begin(), all.end(), batches.begin(),
+                                  batches.end(), std::back_inserter(changed));
+    EXPECT_GE(4u, changed.size()) << srcs[i];
+
+    vector<string> more = srcs;
+    more.push_back("new" + std::to_string(i) + ".cc");
+    changed.clear();
+    const set<string> grown = describe(cppCompileUnits("t", more, attrs));
+    std::set_symmetric_difference(all.begin(), all.end(), grown.begin(),
+                                  grown.end(), std::back_inserter(changed));
+    EXPECT_GE(3u, changed.size()) << more.back();
+  }
+  const vector<CompileUnit> units = cppCompileUnits("t", srcs, no_unity);
+  ASSERT_EQ(srcs.size(), units.size());
+  EXPECT_EQ(".out/t/src0.o", units[0].oFile);
+}
+
+TEST(Attrs, InnerScopesShadowOuterOnes) {
+  auto node = [](int i) { return eden::Node::String(std::to_string(i + 1)); };
+  auto global = std::make_shared<Attrs>();
+  global->Set(":a", node(0));
+  global->Set(":b", node(1));
+  auto module = std::make_shared<Attrs>(global);
+  module->Set(":b", node(2));
+  Attrs rule(module);
+  EXPECT_EQ("1", rule.At(":a").AsString());
+  EXPECT_EQ("3", rule.At(":b").AsString());
+  EXPECT_EQ("2", global->At(":b").AsString());
+  EXPECT_EQ(nullptr, rule.Find(":c"));
+  rule.Set(":a", node(3));
+  rule.Set(":a", node(2));  // Replaces, in the same scope.
+  EXPECT_EQ("3", rule.At(":a").AsString());
+  EXPECT_EQ("1", module->At(":a").AsString());
+}
+
+TEST(Attrs, FindDoesNotInternTheKey) {
+  const eden::Tree map = eden::read("{:set-in-map 1}");
+  Attrs attrs;
+  attrs.SetMap(*map->AsNodes()[0]);
+  EXPECT_EQ(1, attrs.At(":set-in-map").AsInt());
+  EXPECT_EQ(nullptr, attrs.Find(":looked-up-but-never-set"));
+  EXPECT_EQ(nullptr, eden::Interned("looked-up-but-never-set"));
+  EXPECT_EQ(eden::Intern("set-in-map"), eden::Interned("set-in-map"));
+}
+
+// Only changes to files the build looked at, and does not write itself,
+// count as edits.
+TEST(FileStates, ReportsChangesToFilesLookedUp) {
+  ScratchDir scratch;
+  FileStates files;
+  ASSERT_NE(-1, files.Watch());
+  write("in.cc", "int x;\n");
+  write("sub/in.h", "int y;\n");
+  write("out.o", "");
+  write("other", "");
+  for (const string path : {"in.cc", "sub/in.h", "out.o"}) {
+    EXPECT_NE(-1, files.ModTime(path));
+  }
+  files.Written("out.o");
+  EXPECT_NE(-1, files.ModTime("out.o"));
+  write("out.o", "object\n");
+  write("other", "x");
+  EXPECT_EQ(vector<string>(), files.ProcessEvents());
+  write("sub/in.h", "int z;\n");
+  write("in.cc", "int w;\n");
+  EXPECT_EQ(vector<string>({"sub/in.h", "in.cc"}), files.ProcessEvents());
+  write("in.cc", "int v;\n");  // Not looked up since.
+  EXPECT_EQ(vector<string>(), files.ProcessEvents());
+}
+
+TEST(Server, RequestCarriesArgsAndOutput) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  ASSERT_EQ("", sendRequest(fds[0], {"-j", "", "target"}));
+  vector<string> args;
+  int client_fds[2];
+  ASSERT_EQ("", recvRequest(fds[1], &args, client_fds));
+  EXPECT_EQ(vector<string>({"-j", "", "target"}), args);
+  struct stat got, want;
+  ASSERT_EQ(0, fstat(client_fds[1], &got));
+  ASSERT_EQ(0, fstat(STDERR_FILENO, &want));
+  EXPECT_EQ(want.st_ino, got.st_ino);
+  close(client_fds[0]);
+  close(client_fds[1]);
+
+  ASSERT_EQ("", sendRequest(fds[0], {}));
+  ASSERT_EQ("", recvRequest(fds[1], &args, client_fds));
+  EXPECT_TRUE(args.empty());
+  close(client_fds[0]);
+  close(client_fds[1]);
+
+  const uint32_t size = 0;  // No SCM_RIGHTS.
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(size)),
+            write(fds[0], &size, sizeof(size)));
+  EXPECT_EQ("request without file descriptors",
+            recvRequest(fds[1], &args, client_fds));
+  close(fds[0]);
+  EXPECT_EQ("short request", recvRequest(fds[1], &args, client_fds));
+  close(fds[1]);
+}
+
+TEST(Manager, NonStringValues) {
+  const eden::Tree defaults = eden::read("{:out-dir \"./.out/\"}");
+  const auto read = [&](const std::string& aa) {
+    Manager manager(*defaults);
+    return manager.Read(*eden::read(aa));
+  };
+  EXPECT_EQ(":cflags should only hold strings, not int"
+            " (in the rule for z)",
+            read("z (c++lib [] {:src [\"a.cc\"] :cflags [\"-O2\" 3]})"));
+  EXPECT_EQ("Dependency of x should be a name, not bool",
+            read("x (noop [true])"));
+  EXPECT_EQ("", read("y (noop [] {:n 3 :flags [\"-a\"]})"));
+}
+
+TEST(Manager, ServerSocketFollowsTheOutDir) {
+  const eden::Tree defaults = eden::read("{:out-dir \"./.out/\"}");
+  Manager manager(*defaults);
+  EXPECT_EQ("./.out/.aa.sock", serverSocket(manager.OutDir()));
+  ASSERT_EQ("", manager.Index("{:out-dir \"./build/\"}\n"));
+  EXPECT_EQ("./build/.aa.sock", serverSocket(manager.OutDir()));
+}
+
+// Reaches into the Manager for the rules it made.
+class ManagerTest {
+ public:
+  static std::vector<std::string> Deps(Manager* manager,
+                                       const std::string& target) {
+    return manager->rules_.at(target)->Deps();
+  }
+};
+
+TEST(Manager, PchDoesNotDependOnTheRulesRead) {
+  const eden::Tree defaults =
+      eden::read("{:out-dir \"./.out/\" :compiler \"c++\"}");
+  const std::string aa =
+      "a (c++lib [] {:src [\"a.cc\"] :inc [\"vector\"]})\n"
+      "b (c++lib [] {:src [\"b.cc\"] :inc [\"vector\"]})\n";
+  Manager alone(*defaults);
+  ASSERT_EQ("", alone.Index(aa));
+  ASSERT_EQ("", alone.Load({"a"}));
+  Manager both(*defaults);
+  ASSERT_EQ("", both.Index(aa));
+  ASSERT_EQ("", both.Load({"a", "b"}));
+
+  const std::vector<std::string> deps = ManagerTest::Deps(&alone, "a");
+  ASSERT_EQ(1u, deps.size());
+  EXPECT_EQ("pch:", deps[0].substr(0, 4));
+  EXPECT_EQ(deps, ManagerTest::Deps(&both, "a"));
+  EXPECT_EQ(deps, ManagerTest::Deps(&both, "b"));
+}
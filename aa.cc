@@ -29,186 +29,536 @@
 // should be able to express common invokations (std{in,out,err}, args,
 // side-effect output files including temporary outputs (.o, .log, etc.).
 
-// TODO: Currently only the one src can be present.  Fix this.
-error compileCpp(const vector<string>& srcs,
-                 const string& oFile,
-                 const map<string, eden::Node>& attrs) {
-  const string compiler_program = attrs.at(":compiler").AsString();
-  vector<string> flags;
-  if (auto it = attrs.find(":inc"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back("-include");
-      flags.push_back(x->AsString());
+// A single external command a resolver needs to run in order to bring its
+// target up to date.  Resolvers only describe actions; the Manager decides
+// when (and how many at once) to run them.
+struct Action {
+  string kind;     // "compiling", "linking", "install"; used in error messages.
+  string message;  // Printed when the action starts.
+  string program;
+  vector<string> args;
+  vector<string> inputs;   // Files the action reads.
+  vector<string> outputs;  // Files the action writes.
+  // Makefile-style dependencies the action writes for outputs[0], listing
+  // inputs it discovered on its own (e.g., #include'd headers).  Optional.
+  string depfile;
+  // Whether the output only depends on the inputs and the command line, so it
+  // can be shared through the ObjectStore.
+  bool cacheable = false;
+  // Actions of a target run in order of stage; those of the same stage may
+  // run at the same time (e.g., the compiles before a link).
+  size_t stage = 0;
+  // Files the resolver generated for the action (unity sources, PCH
+  // headers); aa's own writes, not edits to react to.
+  vector<string> generated;
+};
+
+// The attributes of a rule, layered over those of its module, over the global
+// ones (from ~/.config/aa/defaults).  Parent scopes are shared, and never
+// change once they have children, so a scope is cheap to copy and looking up
+// a key walks up the chain rather than rules copying whole maps.  Keys are
+// keyword names interned by eden (":cflags" is "cflags"), so the walk compares
+// pointers, and a keyword node's string is its key.
+class Attrs {
+ public:
+  typedef const string* Key;
+  static Key Intern(std::string_view key) {
+    return eden::Intern(key.substr(key[0] == ':' ? 1 : 0));
+  }
+  // Intern() for lookups: nullptr for a key that no scope can have, as every
+  // key set is interned.
+  static Key Interned(std::string_view key) {
+    return eden::Interned(key.substr(key[0] == ':' ? 1 : 0));
+  }
+
+  Attrs() {}
+  explicit Attrs(std::shared_ptr<const Attrs> parent)
+      : parent_(std::move(parent)) {}
+
+  // The value of `key' in the innermost scope that has it, or nullptr.
+  const eden::Node* Find(std::string_view key) const {
+    const Key k = Interned(key);
+    if (k == nullptr) {
+      return nullptr;
+    }
+    const eden::Node keyword = eden::Node::Keyword(k);
+    for (const Attrs* scope = this; scope != nullptr;
+         scope = scope->parent_.get()) {
+      for (const auto& kv : scope->values_) {
+        if (kv.first == k) {
+          return &kv.second;
+        }
+      }
+      if (scope->map_ != nullptr) {
+        if (const eden::Node* value = scope->map_->Get(keyword)) {
+          return value;
+        }
+      }
     }
+    return nullptr;
   }
-  if (auto it = attrs.find(":cflags-default"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back(x->AsString());
+  // Like Find(), for keys the defaults always have (say, :out-dir).
+  const eden::Node& At(std::string_view key) const {
+    const eden::Node* value = Find(key);
+    if (value == nullptr) {
+      std::cerr << "aa: attribute " << key << " is not set\n";
+      exit(1);
     }
+    return *value;
   }
-  if (auto it = attrs.find(":cflags"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back(x->AsString());
+  // Makes the entries of `map', whose keys are keywords, this scope's, under
+  // those Set() in it.  Lookups go through the map's own index, so `map' has
+  // to outlive the Attrs.
+  void SetMap(const eden::Node& map) { map_ = &map; }
+  // Sets `key' in this scope, hiding any value in the parents.
+  void Set(std::string_view key, const eden::Node& value) {
+    const Key k = Intern(key);
+    for (auto& kv : values_) {
+      if (kv.first == k) {
+        kv.second = value;
+        return;
+      }
     }
+    values_.emplace_back(k, value);
   }
-  string srcs_str;
-  string sep = "";
-  flags.push_back("-c");
-  for (const string& src : srcs) {
-    flags.push_back(src);
-    srcs_str += sep + src;
-    sep = ", ";
+
+ private:
+  std::shared_ptr<const Attrs> parent_;
+  const eden::Node* map_ = nullptr;
+  vector<pair<Key, eden::Node>> values_;
+};
+
+// Appends :cflags-default and :cflags to `flags'.
+void appendCflags(const Attrs& attrs, vector<string>* flags) {
+  if (const eden::Node* value = attrs.Find(":cflags-default")) {
+    for (auto x : value->AsNodes()) {
+      flags->emplace_back(x->AsString());
+    }
+  }
+  if (const eden::Node* value = attrs.Find(":cflags")) {
+    for (auto x : value->AsNodes()) {
+      flags->emplace_back(x->AsString());
+    }
+  }
+}
+
+// The :inc entries that are files in the workspace (rather than headers such
+// as "iostream" found on the include path).
+vector<string> incFiles(const Attrs& attrs) {
+  vector<string> files;
+  if (const eden::Node* value = attrs.Find(":inc")) {
+    for (auto x : value->AsNodes()) {
+      if (const string file(x->AsString()); os::ModTime(file) != -1) {
+        files.push_back(file);
+      }
+    }
+  }
+  return files;
+}
+
+// The precompiled form of `header'.  GCC and clang both pick it up for
+// `-include header', but under different names.
+string pchFile(const string& header, const string& compiler) {
+  return header + (compiler.find("clang") != string::npos ? ".pch" : ".gch");
+}
+
+Action compileCpp(const string& src, const string& oFile, const Attrs& attrs) {
+  const string compiler_program(attrs.At(":compiler").AsString());
+  vector<string> flags;
+  if (const eden::Node* value = attrs.Find(":pch")) {
+    // The :inc headers, precompiled by a PchResolver.
+    flags.push_back("-include");
+    flags.emplace_back(value->AsString());
+  } else if (const eden::Node* value = attrs.Find(":inc")) {
+    for (auto x : value->AsNodes()) {
+      flags.push_back("-include");
+      flags.emplace_back(x->AsString());
+    }
   }
+  appendCflags(attrs, &flags);
+  flags.push_back("-c");
+  flags.push_back(src);
   flags.push_back("-o");
   flags.push_back(oFile);
+  const string depfile = oFile + ".d";
+  flags.push_back("-MD");
+  flags.push_back("-MF");
+  flags.push_back(depfile);
 
   // TODO: this condition should come from the command line, not from the AA
   // file.
-  if (attrs.count(":mockingly")) {
-    std::cout << "  compiling (mockingly) " + srcs_str
-              << " => " << oFile << "\n";
-    flags.insert(flags.begin(), compiler_program);
+  if (attrs.Find(":mockingly")) {
+    std::cout << "  compiling (mockingly) " + src << " => " << oFile << "\n";
+    std::cout << " " << compiler_program;
     for (const auto& flag : flags) {
       std::cout << " " << flag;
     }
     std::cout << "\n";
   }
-  std::cout << "  compiling " + srcs_str << " => " << oFile << "\n";
-  return os::ForkExecWait(compiler_program, flags);
+  vector<string> inputs = {src};
+  for (const string& inc : incFiles(attrs)) {
+    inputs.push_back(inc);
+  }
+  return Action{"compiling", "compiling " + src + " => " + oFile,
+                compiler_program, flags, inputs, {oFile}, depfile, true};
 }
 
-error linkCppBinary(const vector<string>& oFiles, const string& binFile,
-                    const map<string, eden::Node>& attrs) {
-  const string linker_program = attrs.at(":linker").AsString();
+// Precompiles `header' (see PchResolver) with the flags of the targets that
+// will include it; the compilers refuse a PCH built with different ones.
+Action compilePch(const string& header, const Attrs& attrs) {
+  const string compiler_program(attrs.At(":compiler").AsString());
+  const string pch = pchFile(header, compiler_program);
+  vector<string> flags;
+  appendCflags(attrs, &flags);
+  flags.insert(flags.end(), {"-x", "c++-header", header, "-o", pch, "-MD",
+                             "-MF", pch + ".d"});
+  vector<string> inputs = incFiles(attrs);
+  inputs.push_back(header);
+  // Not cacheable: the PCH refers to the headers by absolute path.
+  return Action{"precompiling", "precompiling " + header + " => " + pch,
+                compiler_program, flags, inputs, {pch}, pch + ".d", false};
+}
+
+Action linkCppBinary(const vector<string>& oFiles, const string& binFile,
+                     const Attrs& attrs) {
+  const string linker_program(attrs.At(":linker").AsString());
   vector<string> flags(oFiles.begin(), oFiles.end());
   flags.push_back("-o");
   flags.push_back(binFile);
-  if (auto it = attrs.find(":lib"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back("-l" + x->AsString());
+  if (const eden::Node* value = attrs.Find(":lib")) {
+    for (auto x : value->AsNodes()) {
+      flags.push_back("-l" + string(x->AsString()));
+    }
+  }
+  if (const eden::Node* value = attrs.Find(":lflags-default")) {
+    for (auto x : value->AsNodes()) {
+      flags.emplace_back(x->AsString());
+    }
+  }
+  if (const eden::Node* value = attrs.Find(":lflags")) {
+    for (auto x : value->AsNodes()) {
+      flags.emplace_back(x->AsString());
+    }
+  }
+  return Action{"linking", "linking => " + binFile, linker_program, flags,
+                oFiles, {binFile}, "", true};
+}
+
+// The :src of a C++ target.
+error cppSrcs(const string& target, const Attrs& attrs,
+              vector<string>* srcs) {
+  const eden::Node* src = attrs.Find(":src");
+  if (src == nullptr) {
+    return ":src key not found for target " + target;
+  }
+  for (const eden::Node* node : src->AsNodes()) {
+    if (!node->IsString()) {
+      return "src has the wrone type " + node->Typename();
     }
+    srcs->emplace_back(node->AsString());
   }
-  if (auto it = attrs.find(":lflags-default"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back(x->AsString());
+  return "";
+}
+
+// A translation unit of a C++ target.  In unity mode, `unity' is a generated
+// file that #includes `srcs' and is compiled in their stead.
+struct CompileUnit {
+  vector<string> srcs;
+  string oFile;
+  string unity;
+};
+
+// Splits the sources of `target' into translation units.  Normally each
+// source path/to/src.cc is one, compiled into .out/<target>/path/to/src.o.
+// With :unity-batch-size N they are batched
+// into generated .out/<target>/unity-HASH.cc files of about N sources each.
+// A batch boundary falls before every source whose name hashes to 0 mod N,
+// and nowhere else, so adding or removing a source only reshuffles its own
+// batch and its neighbour.
+vector<CompileUnit> cppCompileUnits(const string& target,
+                                    const vector<string>& srcs,
+                                    const Attrs& attrs) {
+  const string outDir(attrs.At(":out-dir").AsString());
+  const eden::Node* batch = attrs.Find(":unity-batch-size");
+  if (batch == nullptr) {
+    vector<CompileUnit> units;
+    for (const string& src : srcs) {
+      units.push_back(
+          {{src}, outDir + target + "/" + path::SansExt(src) + ".o", ""});
+    }
+    return units;
+  }
+  const uint64_t batch_size = static_cast<uint64_t>(
+      std::max<int64_t>(1, batch->IsInt() ? batch->AsInt() : 1));
+  vector<string> sorted = srcs;
+  std::sort(sorted.begin(), sorted.end());
+  vector<CompileUnit> units;
+  for (const string& src : sorted) {
+    if (units.empty() || strings::Hash(src) % batch_size == 0) {
+      const string base =
+          outDir + target + "/unity-" + strings::Hex(strings::Hash(src));
+      units.push_back({{}, base + ".o", base + ".cc"});
     }
+    units.back().srcs.push_back(src);
+  }
+  return units;
+}
+
+// Appends the compiles of `target', writing its unity files if needed.
+error compileCppUnits(const string& target, const Attrs& attrs,
+                      vector<Action>* actions, vector<string>* oFiles) {
+  vector<string> srcs;
+  if (error err = cppSrcs(target, attrs, &srcs); err != "") {
+    return err;
   }
-  if (auto it = attrs.find(":lflags"); it != attrs.end()) {
-    for (auto x : it->second.AsNodes()) {
-      flags.push_back(x->AsString());
+  for (const CompileUnit& unit : cppCompileUnits(target, srcs, attrs)) {
+    oFiles->push_back(unit.oFile);
+    if (unit.unity.empty()) {
+      actions->push_back(compileCpp(unit.srcs[0], unit.oFile, attrs));
+      continue;
+    }
+    string text;
+    for (const string& src : unit.srcs) {
+      text += "#include \"" + path::Absolute(src) + "\"\n";
     }
+    if (error err = strings::WriteFileIfChanged(unit.unity, text);
+        err != "") {
+      return err;
+    }
+    Action action = compileCpp(unit.unity, unit.oFile, attrs);
+    action.inputs.insert(action.inputs.end(), unit.srcs.begin(),
+                         unit.srcs.end());
+    action.generated.push_back(unit.unity);
+    actions->push_back(std::move(action));
   }
-  std::cout << "  linking => " + binFile << "\n";
-  os::ForkExecWait(linker_program, flags);
   return "";
 }
 
 class Resolver { // interface
  public:
-  virtual error Resolve(const string& target) = 0;
+  virtual ~Resolver() {}
+  // Appends to `actions' the commands that bring `target' up to date, in the
+  // order they have to run.
+  virtual error Resolve(const string& target, vector<Action>* actions) = 0;
   virtual const vector<string>& Deps() = 0;
+  // Makes the target include `header', precompiled by the target
+  // `pch_target', instead of its :inc headers.  Only C++ resolvers can.
+  virtual void UsePch(const string& pch_target, const string& header) {}
+  // The object files that binaries depending on `target' link in.
+  virtual vector<string> Objects(const string& target) { return {}; }
+};
+
+typedef map<string, unique_ptr<Resolver>> Rules;
+
+// What binaries link: the objects of all the targets they depend on,
+// directly or not, each target once and before the targets it depends on
+// (the order static archives need).  The closures of shared deps are
+// computed once.
+class LinkClosure {
+ public:
+  explicit LinkClosure(const Rules* rules) : rules_(rules) {}
+
+  // The objects of the deps of `target', to link after its own.
+  vector<string> Objects(const string& target) {
+    const vector<string>& order = postorder(target);
+    vector<string> objects;
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+      if (*it != target) {
+        for (const string& object : rules_->at(*it)->Objects(*it)) {
+          objects.push_back(object);
+        }
+      }
+    }
+    return objects;
+  }
+
+ private:
+  // `target' and its transitive deps, each after all of its own deps.
+  const vector<string>& postorder(const string& target) {
+    if (auto it = postorders_.find(target); it != postorders_.end()) {
+      return it->second;
+    }
+    vector<string> order;
+    set<string> seen;
+    if (auto it = rules_->find(target); it != rules_->end()) {
+      for (const string& dep : it->second->Deps()) {
+        for (const string& x : postorder(dep)) {
+          if (seen.insert(x).second) {
+            order.push_back(x);
+          }
+        }
+      }
+    }
+    order.push_back(target);
+    return postorders_[target] = std::move(order);
+  }
+
+  const Rules* rules_;
+  map<string, vector<string>> postorders_;
 };
 
 class CppbinResolver : public Resolver {
  public:
-  CppbinResolver(const vector<string>& deps,
-                 const map<string, eden::Node>& attrs)
-      : deps_(deps), attrs_(attrs) {}
+  CppbinResolver(const vector<string>& deps, const Attrs& attrs,
+                 LinkClosure* link_closure)
+      : deps_(deps), attrs_(attrs), link_closure_(link_closure) {}
   ~CppbinResolver() {}
   const vector<string>& Deps() override { return deps_; }
+  void UsePch(const string& pch_target, const string& header) override {
+    deps_.push_back(pch_target);
+    pch_header_ = header;
+    attrs_.Set(":pch", eden::Node::String(pch_header_));
+  }
 
-  error Resolve(const string& target) override {
-    const string outDir = attrs_.at(":out-dir").AsString();
-    const string binDir = attrs_.at(":bin-dir").AsString();
-    auto it_srcs = attrs_.find(":src");
-    if (it_srcs == attrs_.end()) {
-      return ":src key not found for target " + target;
-    }
-    std::vector<std::string> srcs;
-    for (const eden::Node* node : it_srcs->second.AsNodes()) {
-      if (!node->IsString()) {
-        return "src has the wrone type " + node->Typename();
-      }
-      srcs.push_back(node->AsString());
+  error Resolve(const string& target, vector<Action>* actions) override {
+    const string binDir(attrs_.At(":bin-dir").AsString());
+    vector<string> oFiles;
+    if (error err = compileCppUnits(target, attrs_, actions, &oFiles);
+        err != "") {
+      return err;
     }
-    const string oFile = outDir + target + ".o";
-    vector<string> oFiles = {oFile};
-    for (const string& dep : deps_) {
-      oFiles.push_back(outDir + dep + ".o");
+    for (const string& oFile : link_closure_->Objects(target)) {
+      oFiles.push_back(oFile);
     }
     const string binFile = binDir + target;
-    error err = compileCpp(srcs, oFile, attrs_);
-    if (err != "") {
-      return "[compiling]" + err;
-    }
-    err = linkCppBinary(oFiles, binFile, attrs_);
-    if (err != "") {
-      return "[linking]" + err;
-    }
+    Action link = linkCppBinary(oFiles, binFile, attrs_);
+    link.stage = 1;  // After all the compiles.
+    actions->push_back(std::move(link));
     return "";
   }
  private:
-  const vector<string> deps_;
-  const map<string, eden::Node> attrs_;
+  vector<string> deps_;
+  Attrs attrs_;
+  LinkClosure* link_closure_;
+  string pch_header_;
 };
 
 class CpplibResolver : public Resolver {
  public:
-  CpplibResolver(const vector<string>& deps,
-                 const map<string, eden::Node>& attrs)
+  CpplibResolver(const vector<string>& deps, const Attrs& attrs)
       : deps_(deps), attrs_(attrs) {}
   ~CpplibResolver() {}
   const vector<string>& Deps() override { return deps_; }
+  void UsePch(const string& pch_target, const string& header) override {
+    deps_.push_back(pch_target);
+    pch_header_ = header;
+    attrs_.Set(":pch", eden::Node::String(pch_header_));
+  }
+  vector<string> Objects(const string& target) override {
+    vector<string> srcs;
+    cppSrcs(target, attrs_, &srcs);
+    vector<string> oFiles;
+    for (const CompileUnit& unit : cppCompileUnits(target, srcs, attrs_)) {
+      oFiles.push_back(unit.oFile);
+    }
+    return oFiles;
+  }
+
+  error Resolve(const string& target, vector<Action>* actions) override {
+    vector<string> oFiles;
+    return compileCppUnits(target, attrs_, actions, &oFiles);
+  }
+ protected:
+  vector<string> deps_;
+  Attrs attrs_;
+  string pch_header_;
+};
 
-  error Resolve(const string& target) override {
-    const string outDir = attrs_.at(":out-dir").AsString();
+// A c++lib that also bundles its objects into .out/lib<target>.a, which is
+// what dependent binaries link.  With `:thin true' the archive only refers
+// to the objects instead of holding copies.
+class CpparchiveResolver : public CpplibResolver {
+ public:
+  CpparchiveResolver(const vector<string>& deps, const Attrs& attrs)
+      : CpplibResolver(deps, attrs) {}
+  ~CpparchiveResolver() {}
+  vector<string> Objects(const string& target) override {
+    return {archive(target)};
+  }
 
-    auto it_srcs = attrs_.find(":src");
-    if (it_srcs == attrs_.end()) {
-      return ":src key not found for target " + target;
+  error Resolve(const string& target, vector<Action>* actions) override {
+    vector<string> oFiles;
+    if (error err = compileCppUnits(target, attrs_, actions, &oFiles);
+        err != "") {
+      return err;
     }
-    std::vector<std::string> srcs;
-    for (const eden::Node* node : it_srcs->second.AsNodes()) {
-      if (!node->IsString()) {
-        return "src has the wrone type " + node->Typename();
-      }
-      srcs.push_back(node->AsString());
+    string archiver = "/usr/bin/ar";
+    if (const eden::Node* value = attrs_.Find(":archiver")) {
+      archiver = value->AsString();
     }
-    const string oFile = outDir + target + ".o";
-    error err = compileCpp(srcs, oFile, attrs_);
-    if (err != "") {
-      return "[compiling] " + err;
+    const eden::Node* thin_node = attrs_.Find(":thin");
+    const bool thin =
+        thin_node != nullptr && thin_node->IsBool() && thin_node->AsBool();
+    vector<string> args = {thin ? "rcsT" : "rcs", archive(target)};
+    args.insert(args.end(), oFiles.begin(), oFiles.end());
+    // A thin archive is only good next to its objects.
+    Action ar{"archiving", "archiving => " + archive(target), archiver, args,
+              oFiles, {archive(target)}, "", !thin};
+    ar.stage = 1;
+    actions->push_back(std::move(ar));
+    return "";
+  }
+
+ private:
+  string archive(const string& target) {
+    return string(attrs_.At(":out-dir").AsString()) + "lib" + target + ".a";
+  }
+};
+
+// Precompiles a set of :inc headers for the C++ targets that use it.  Not
+// named in AA files; the Manager adds one for each set (see processRule).
+// `header' is generated to #include the set.
+class PchResolver : public Resolver {
+ public:
+  PchResolver(const string& header, const Attrs& attrs)
+      : header_(header), attrs_(attrs) {}
+  ~PchResolver() {}
+  const vector<string>& Deps() override { return deps_; }
+
+  error Resolve(const string& target, vector<Action>* actions) override {
+    string text;
+    for (const eden::Node* node : attrs_.At(":inc").AsNodes()) {
+      const string inc(node->AsString());
+      text += os::ModTime(inc) != -1
+          ? "#include \"" + path::Absolute(inc) + "\"\n"
+          : "#include <" + inc + ">\n";
+    }
+    if (error err = strings::WriteFileIfChanged(header_, text); err != "") {
+      return err;
     }
+    actions->push_back(compilePch(header_, attrs_));
+    actions->back().generated.push_back(header_);
     return "";
   }
  private:
-  const vector<string> deps_;
-  const map<string, eden::Node> attrs_;
+  const vector<string> deps_;  // empty
+  const string header_;
+  const Attrs attrs_;
 };
 
 class InstallResolver : public Resolver {
  public:
-  InstallResolver(const vector<string>& deps,
-                 const map<string, eden::Node>& attrs)
+  InstallResolver(const vector<string>& deps, const Attrs& attrs)
       : deps_(deps), attrs_(attrs) {}
   ~InstallResolver() {}
 
   const vector<string>& Deps() override { return deps_; }
 
-  error Resolve(const string& target) override {
-    const string binDir = attrs_.at(":bin-dir").AsString();
+  error Resolve(const string& target, vector<Action>* actions) override {
+    const string binDir(attrs_.At(":bin-dir").AsString());
 
     for (const string& dep : deps_) {
       // cp .bin/DEP ~/.local/bin/DEP
       const string program_path = os::HomeDir() + "/.local/bin/" + dep;
-      os::ForkExecWait("/bin/cp", {binDir + dep, program_path});
-      std::cout << "  install => " << program_path << "\n";
+      actions->push_back(Action{"install", "install => " + program_path,
+                                "/bin/cp", {binDir + dep, program_path},
+                                {binDir + dep}, {program_path}});
     }
     return "";
   }
  private:
   const vector<string> deps_;
-  const map<string, eden::Node> attrs_;
+  const Attrs attrs_;
 };
 
 class NoopResolver : public Resolver {
@@ -219,54 +569,82 @@ class NoopResolver : public Resolver {
 
   const vector<string>& Deps() override { return deps_; }
 
-  error Resolve(const string& target) override {
+  error Resolve(const string& target, vector<Action>* actions) override {
     std::cout << "  noop => " << target << "\n";
     return "";
   }
 };
 
+struct BuildState;
+
 class Manager {
  public:
-  Manager(const eden::Node& global_attrs_root) {
-    global_attrs_.clear();
+  Manager(const eden::Node& global_attrs_root)
+      : global_attrs_(std::make_shared<Attrs>()),
+        module_attrs_(global_attrs_) {
     auto it = global_attrs_root.AsNodes().cbegin();
     auto itEnd = global_attrs_root.AsNodes().cend();
     if (it != itEnd && (*it)->IsMap()) {
-      std::cerr << processAttributes(**it, &global_attrs_);
+      std::cerr << processAttributes(**it, global_attrs_.get());
     }
   }
   ~Manager() {}
-  error Read();
-  error Resolve(const vector<string>& targets);
+  // Maximum number of resolver subprocesses to run at the same time.
+  void SetJobs(size_t jobs) { jobs_ = jobs; }
+  // The AA file to Read().
+  const string AaFile() { return string(global_attrs_->At(":aa").AsString()); }
+  // Where outputs and build state go, per the attributes read so far.
+  const string OutDir() {
+    return string(module_attrs_->At(":out-dir").AsString());
+  }
+  error Read(const eden::Node& spec_root);
+  // Like Read(), for the text of an AA file, which has to outlive the
+  // Manager.  Only finds where each rule is; Load() reads the ones a build
+  // needs.
+  error Index(std::string_view text);
+  // Reads the rules of `targets' and of everything they depend on, but for
+  // those read already.
+  error Load(const vector<string>& targets);
+  // If `changes' is given, actions whose inputs change on disk while they run
+  // are cancelled, and the files that changed are added to `*changes'.
+  error Resolve(const vector<string>& targets, BuildState* state,
+                set<string>* changes = nullptr);
   const string ListTargets();
 
  private:
-  error processAttributes(const eden::Node& attrs_root,
-                          map<string, eden::Node>* attrs);
+  error processAttributes(const eden::Node& attrs_root, Attrs* attrs);
   error processRule(const string& targetname, const eden::Node& rule);
 
-  map<string, eden::Node> global_attrs_;
-  map<string, eden::Node> module_attrs_;
-  map<string, unique_ptr<Resolver>> rules_;
-};
+  // Rules' attributes are scopes on top of these.  Never changed once a rule
+  // refers to them.
+  std::shared_ptr<Attrs> global_attrs_;
+  std::shared_ptr<Attrs> module_attrs_;
+  Rules rules_;
+  LinkClosure link_closure_{&rules_};
+  // The rules of an Index()ed AA file not read yet, by target; both slices
+  // of its text.
+  std::unordered_map<std::string_view, std::string_view> unread_rules_;
+  // The trees of what was read of it, which attributes refer into.
+  vector<eden::Tree> trees_;
+  size_t jobs_ = 1;
 
-error Manager::Read() {
-  const string aaFile = global_attrs_[":aa"].AsString();
-  const string specStr = strings::ReadFileToString(aaFile);
-  std::unique_ptr<eden::Node> spec_root = eden::read(specStr);
+  friend class ManagerBenchmark;  // aa-bench.cc
+  friend class ManagerTest;  // aa-test.cc
+};
 
+error Manager::Read(const eden::Node& spec_root) {
   // populate list of rules and parameters from the node tree.
   // Node tree should look like the following:
   // (module MODULE-NAME {:ATTR-KEY ATTR-VALUE ...}
   //   (RULENAME TARGET [DEP1 DEP2 ...] {:PARAMETER VALUE}))
-  auto it = spec_root->AsNodes().cbegin();
-  auto itEnd = spec_root->AsNodes().cend();
+  auto it = spec_root.AsNodes().cbegin();
+  auto itEnd = spec_root.AsNodes().cend();
+  module_attrs_ = std::make_shared<Attrs>(global_attrs_);
   if (it == itEnd) {
     return "";  // Empty spec.
   }
   if ((*it)->IsMap()) {
-    module_attrs_ = global_attrs_; // Copy.
-    error err = processAttributes(**it, &module_attrs_);
+    error err = processAttributes(**it, module_attrs_.get());
     if (err != "") {
       return err;
     }
@@ -276,7 +654,7 @@ error Manager::Read() {
     if (!(*it)->IsSymbol()) {
       return "Target name is required here.";
     }
-    const string& target = (*it)->AsString();
+    const string target((*it)->AsString());
     ++it;
     error err = processRule(target, **it);
     if (err != "") {
@@ -286,35 +664,106 @@ error Manager::Read() {
   return "";
 }
 
+error Manager::Index(std::string_view text) {
+  vector<std::string_view> forms;
+  string err;
+  if (!eden::IndexForms(text, &forms, &err)) {
+    return err;
+  }
+  module_attrs_ = std::make_shared<Attrs>(global_attrs_);
+  unread_rules_.reserve(forms.size() / 2);
+  auto it = forms.cbegin();
+  if (it != forms.cend() && (*it)[0] == '{') {
+    eden::Tree attrs = eden::read(*it);
+    if (attrs == nullptr) {
+      return "Module attributes do not parse";
+    }
+    if (err = processAttributes(*attrs->AsNodes()[0], module_attrs_.get());
+        err != "") {
+      return err;
+    }
+    trees_.push_back(std::move(attrs));
+    ++it;
+  }
+  for (; it != forms.cend(); ++it) {
+    // A bare token; the rest of a symbol's syntax is checked when it is read.
+    if (strchr("([{\"#:\\^`'~0123456789", (*it)[0]) != nullptr) {
+      return "Target name is required here.";
+    }
+    const std::string_view target = *it;
+    if (++it == forms.cend()) {
+      return "Missing rule for " + string(target);
+    }
+    unread_rules_[target] = *it;
+  }
+  return "";
+}
+
+error Manager::Load(const vector<string>& targets) {
+  vector<string> pending = targets;
+  while (!pending.empty()) {
+    const string target = std::move(pending.back());
+    pending.pop_back();
+    auto it = unread_rules_.find(target);
+    if (it == unread_rules_.end()) {
+      continue;  // Read already, or not there (which Resolve() reports).
+    }
+    eden::Tree rule = eden::read(it->second);
+    unread_rules_.erase(it);
+    if (rule == nullptr || rule->AsNodes().size() != 1) {
+      return "Rule for " + target + " does not parse";
+    }
+    if (error err = processRule(target, *rule->AsNodes()[0]); err != "") {
+      return err;
+    }
+    trees_.push_back(std::move(rule));
+    for (const string& dep : rules_[target]->Deps()) {
+      pending.push_back(dep);
+    }
+  }
+  return "";
+}
+
 error Manager::processAttributes(const eden::Node& attrs_root,
-                                 map<string, eden::Node>* attrs) {
+                                 Attrs* attrs) {
   auto it = attrs_root.AsNodes().cbegin();
   auto itEnd = attrs_root.AsNodes().cend();
   while (it != itEnd) {
     if (!(*it)->IsKeyword()) {
       return "Map key is expected to be a keyword here";
     }
-    const string& key = ":" + (*it)->AsString();
+    const std::string_view key = (*it)->AsString();
     if (++it == itEnd) {
       return "Map key found without a value "
              "(i.e., odd number of Atoms between {})";
     }
-    const eden::Node& value = **it;
+    // Lists of files, flags and libraries, all read as strings.
+    if ((*it)->IsVector() || (*it)->IsList()) {
+      for (const eden::Node* item : (*it)->AsNodes()) {
+        if (!item->IsString() && !item->IsSymbol()) {
+          return ":" + string(key) + " should only hold strings, not " +
+                 item->Typename();
+        }
+      }
+    }
     ++it;
-    attrs->emplace(key, value);
   }
+  attrs->SetMap(attrs_root);
   return "";
 }
 
 Resolver* CreateResolverByName(const string& resolver_name,
-                               const vector<string>& deps,
-                               const map<string, eden::Node>& attrs) {
+                               const vector<string>& deps, const Attrs& attrs,
+                               LinkClosure* link_closure) {
   if (resolver_name == "c++bin") {
-    return new CppbinResolver(deps, attrs);
+    return new CppbinResolver(deps, attrs, link_closure);
   }
   if (resolver_name == "c++lib") {
     return new CpplibResolver(deps, attrs);
   }
+  if (resolver_name == "c++archive") {
+    return new CpparchiveResolver(deps, attrs);
+  }
   if (resolver_name == "install") {
     return new InstallResolver(deps, attrs);
   }
@@ -330,7 +779,7 @@ error Manager::processRule(const string& target, const eden::Node& rule) {
   }
   auto it = rule.AsNodes().begin();
   auto itEnd = rule.AsNodes().end();
-  const string& resolver_name = (*it)->AsString();
+  const string resolver_name((*it)->AsString());
   // We need a vector of dependencies here.
   if (++it == itEnd || !(*it)->IsVector()) {
     return "Missing array of dependencies";
@@ -338,179 +787,2450 @@ error Manager::processRule(const string& target, const eden::Node& rule) {
   vector<string> deps;
   deps.reserve((*it)->AsNodes().size());
   for (const eden::Node* node : (*it)->AsNodes()) {
-    deps.push_back(node->AsString());
+    if (!node->IsSymbol() && !node->IsString()) {
+      return "Dependency of " + target + " should be a name, not " +
+             node->Typename();
+    }
+    deps.emplace_back(node->AsString());
   }
 
   // Often, there is a map of rule attributes here.
-  map<string, eden::Node> attrs(module_attrs_.begin(), module_attrs_.end());
+  Attrs attrs(module_attrs_);
   if (++it != itEnd && (*it)->IsMap()) {
-    auto m = (*it)->AsNodes().begin();
-    auto mEnd = (*it)->AsNodes().end();
-    for (;;) {
-      if (m == mEnd) {
-        break;
-      }
-      if (!(*m)->IsKeyword()) {
-        return "Map key is expected to be a keyword here";
-      }
-      const string& key = ":" + (*m)->AsString();
-      if (++m == mEnd) {
-        return "Map key found without a value "
-               "(i.e., odd number of Atoms between {})";
-      }
-      const eden::Node& value = **m;
-      ++m;
-      attrs[key] = value;
+    if (error err = processAttributes(**it, &attrs); err != "") {
+      return err + " (in the rule for " + target + ")";
     }
   }
   // Dispatch on resolver_name.
   // TODO: The `if' branches should be replaced with a map or something.
-  Resolver* resolver = CreateResolverByName(resolver_name, deps, attrs);
+  Resolver* resolver =
+      CreateResolverByName(resolver_name, deps, attrs, &link_closure_);
   if (resolver == nullptr) {
     return "Unknown rule resolver " + resolver_name;
   }
   rules_[target].reset(resolver);
+  if ((resolver_name == "c++bin" || resolver_name == "c++lib" ||
+       resolver_name == "c++archive") &&
+      attrs.Find(":inc")) {
+    // What the PCH would be built from, one line each.
+    uint64_t key = strings::kHashSeed;
+    auto add = [&key](std::string_view s) {
+      key = strings::Hash("\n", 1, strings::Hash(s.data(), s.size(), key));
+    };
+    add(attrs.At(":compiler").AsString());
+    for (const eden::Node* node : attrs.At(":inc").AsNodes()) {
+      add(node->AsString());
+    }
+    for (const char* flags : {":cflags-default", ":cflags"}) {
+      if (const eden::Node* value = attrs.Find(flags)) {
+        for (const eden::Node* flag : value->AsNodes()) {
+          add(flag->AsString());
+        }
+      }
+      add("");
+    }
+    // Every target with the same key uses the same PCH, whatever other
+    // rules are read, so the actions of a target never depend on them.
+    const string name = strings::Hex(key);
+    const string pch_target = "pch:" + name;
+    const string header =
+        string(attrs.At(":out-dir").AsString()) + "pch/" + name + ".h";
+    if (rules_.count(pch_target) == 0) {
+      rules_[pch_target].reset(new PchResolver(header, attrs));
+    }
+    resolver->UsePch(pch_target, header);
+  }
   return "";
 }
 
-// Given the digraph F in which x->y means y should be resolved before x,
-// create the reverse digraph B going from y to x.  Given B find out the
-// leaves (nodes with no outgoing edges), and put them in the layer (phase) 1.
-// Then remove the leaves from the dependencies of the cover of leaves, and
-// repeat the process.
-pair<error, vector<set<string>>> sortIntoPhases(const set<string>& targets,
-                                                map<string, set<string>> F) {
-  vector<set<string>> phases;
-  set<string> seen;
-  set<string> leaves;
-  map<string, set<string>> rdepends;
-  std::deque<string> q_init(targets.cbegin(), targets.cend());
-  for (std::queue<string> q(q_init); !q.empty();) {
-    const string target = q.front();
-    q.pop();
-    if (!seen.insert(target).second) {
-      continue;
-    }
-    const auto it_deps = F.find(target);
-    if (it_deps == F.end()) {
-      return make_pair("Couldn't find node " + target + " in rules.", phases);
-    }
-    const set<string>& deps = it_deps->second;
-    if (deps.empty()) {
-      leaves.insert(target);
-      continue;
+// Records what aa spends its time on as Chrome trace events, the JSON format
+// that Perfetto (ui.perfetto.dev) and chrome://tracing read.  Track 0 is aa
+// itself (parsing, planning, up-to-date checks); tracks 1 to N are the
+// Executor's worker slots, one subprocess at a time.  Does nothing unless
+// Start()ed, which `aa --trace=FILE' does.
+class Tracer {
+ public:
+  static Tracer* Get() {
+    static Tracer tracer;
+    return &tracer;
+  }
+
+  bool enabled() const { return enabled_; }
+  void Start() {
+    enabled_ = true;
+    events_.clear();
+    start_us_ = os::NowMicros();
+  }
+  // Adds a complete event ("ph": "X").  `args' are (key, value) pairs.
+  void Slice(const string& name, const string& category, size_t track,
+             int64_t begin_us, int64_t end_us,
+             const vector<pair<string, string>>& args = {});
+  // Writes the events recorded since Start() and stops recording.
+  error Finish(const string& path);
+
+ private:
+  Tracer() {}
+
+  bool enabled_ = false;
+  int64_t start_us_ = 0;
+  size_t num_tracks_ = 1;
+  string events_;
+};
+
+void Tracer::Slice(const string& name, const string& category, size_t track,
+                   int64_t begin_us, int64_t end_us,
+                   const vector<pair<string, string>>& args) {
+  if (!enabled_) {
+    return;
+  }
+  num_tracks_ = std::max(num_tracks_, track + 1);
+  events_ += events_.empty() ? "\n" : ",\n";
+  events_ += "{\"name\":" + strings::JsonQuote(name) +
+             ",\"cat\":" + strings::JsonQuote(category) +
+             ",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(track) +
+             ",\"ts\":" + std::to_string(begin_us - start_us_) +
+             ",\"dur\":" + std::to_string(end_us - begin_us);
+  if (!args.empty()) {
+    string sep = ",\"args\":{";
+    for (const auto& kv : args) {
+      events_ += sep + strings::JsonQuote(kv.first) + ":" +
+                 strings::JsonQuote(kv.second);
+      sep = ",";
     }
-    for (const string& dep : deps) {
-      if (F.find(dep) == F.end()) {
-        return make_pair("Couldn't find node " + dep + " in rules.", phases);
-      }
-      q.push(dep);
-      rdepends[dep].insert(target);
+    events_ += "}";
+  }
+  events_ += "}";
+}
+
+error Tracer::Finish(const string& path) {
+  enabled_ = false;
+  string json = "{\"traceEvents\":[";
+  for (size_t track = 0; track < num_tracks_; ++track) {
+    json += "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+            std::to_string(track) + ",\"args\":{\"name\":\"" +
+            (track == 0 ? string("aa") :
+             "worker " + std::to_string(track)) + "\"}},";
+  }
+  json += events_ + "\n],\"displayTimeUnit\":\"ms\"}\n";
+  events_.clear();
+  std::ofstream out(path);
+  out << json;
+  out.close();
+  return out ? "" : "could not write " + path;
+}
+
+// Traces the lifetime of a scope as a slice on aa's own track.
+class TraceSpan {
+ public:
+  TraceSpan(const string& name, vector<pair<string, string>> args = {})
+      : name_(name), args_(std::move(args)),
+        begin_us_(Tracer::Get()->enabled() ? os::NowMicros() : 0) {}
+  ~TraceSpan() {
+    Tracer* tracer = Tracer::Get();
+    if (tracer->enabled()) {
+      tracer->Slice(name_, "aa", 0, begin_us_, os::NowMicros(), args_);
     }
   }
 
-  while (!leaves.empty()) {
-    phases.push_back(leaves);
-    set<string> leaves_cover;
-    for (const string& leaf : leaves) {
-      const set<string>& leaf_cover = rdepends[leaf];
-      leaves_cover.insert(leaf_cover.cbegin(), leaf_cover.cend());
+ private:
+  const string name_;
+  const vector<pair<string, string>> args_;
+  const int64_t begin_us_;
+};
+
+// Remembers, for every output file, the fingerprint of the command line that
+// last produced it.  The log is a sequence of fixed-size records (hash of the
+// output path, fingerprint), appended after every successful action; later
+// records win.  It is compacted when loading if most records are stale.
+class BuildLog {
+ public:
+  BuildLog() {}
+  ~BuildLog() {
+    if (fd_ != -1) {
+      close(fd_);
     }
-    set<string> next_leaves;
-    for (const string& x : leaves_cover) {
-      auto it_deps = F.find(x);
-      if (it_deps == F.end()) {
-        return make_pair("Couldn't find node " + x + " in F.", phases);
-      }
-      set<string>* deps = &(it_deps->second);
-      for (const string& leaf : leaves) {
-        deps->erase(leaf);
-      }
-      if (deps->empty()) {
-        next_leaves.insert(x);
-      }
+  }
+
+  error Open(const string& path);
+  bool Matches(const string& output, uint64_t fingerprint) const {
+    auto it = entries_.find(strings::Hash(output));
+    return it != entries_.end() && it->second == fingerprint;
+  }
+  void Record(const string& output, uint64_t fingerprint);
+
+  static uint64_t Fingerprint(const Action& action) {
+    uint64_t h = strings::Hash(action.program);
+    for (const string& arg : action.args) {
+      h = strings::Hash("", 1, h);  // Separator, so {"ab"} != {"a", "b"}.
+      h = strings::Hash(arg, h);
     }
-    leaves = next_leaves;
+    return h;
   }
 
-  return make_pair("", phases);
-}
+ private:
+  static constexpr char kMagic[8] = {'A', 'A', 'L', 'O', 'G', 0, 0, 1};
+  struct Record_ {
+    uint64_t output;
+    uint64_t fingerprint;
+  };
 
-error Manager::Resolve(const vector<string>& targets) {
-  error err = "";
-  set<string> target_set(targets.begin(), targets.end());
-  map<string, set<string>> dependencies;
-  for (const auto& kv : rules_) {
-    const string& target = kv.first;
-    const vector<string>& deps = kv.second->Deps();
-    dependencies[target].insert(deps.begin(), deps.end());
+  map<uint64_t, uint64_t> entries_;
+  int fd_ = -1;
+};
+
+error BuildLog::Open(const string& path) {
+  if (error err = path::MakeContainingDir(path); err != "") {
+    return err;
   }
-  vector<set<string>> phases;
-  {
-    auto err_and_phases = sortIntoPhases(target_set, dependencies);
-    err = err_and_phases.first;
-    if (err != "") {
-      return err;
+  const string contents = strings::ReadFileToString(path);
+  size_t num_records = 0;
+  if (contents.size() >= sizeof(kMagic) &&
+      contents.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) == 0) {
+    num_records = (contents.size() - sizeof(kMagic)) / sizeof(Record_);
+    for (size_t i = 0; i < num_records; ++i) {
+      Record_ r;
+      memcpy(&r, contents.data() + sizeof(kMagic) + i * sizeof(Record_),
+             sizeof(r));
+      entries_[r.output] = r.fingerprint;
     }
-    phases = err_and_phases.second;
   }
+  // Start over if the log is missing, from another version, or mostly stale.
+  const bool rewrite =
+      num_records == 0 || num_records > 2 * entries_.size() + 1000;
+  if (!rewrite) {
+    fd_ = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    return fd_ == -1 ? "could not open " + path : "";
+  }
+  const string tmp = path + ".tmp";
+  fd_ = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    return "could not create " + tmp;
+  }
+  string data(kMagic, sizeof(kMagic));
+  for (const auto& kv : entries_) {
+    Record_ r{kv.first, kv.second};
+    data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+  }
+  if (write(fd_, data.data(), data.size()) !=
+          static_cast<ssize_t>(data.size()) ||
+      rename(tmp.c_str(), path.c_str()) != 0) {
+    close(fd_);
+    fd_ = -1;
+    return "could not write " + path;
+  }
+  return "";
+}
 
-  for (size_t i = 0; i < phases.size(); ++i) {
-    const set<string> phase_targets = phases[i];
-    std::cout << "Phase " << i << ":\n";
-    for (const string& target : phase_targets) {
-      auto it = rules_.find(target);
-      if (it == rules_.end()) {
-        continue;
+void BuildLog::Record(const string& output, uint64_t fingerprint) {
+  Record_ r{strings::Hash(output), fingerprint};
+  entries_[r.output] = r.fingerprint;
+  if (fd_ != -1 && write(fd_, &r, sizeof(r)) != sizeof(r)) {
+    std::cerr << "aa: could not append to the build log\n";
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+// Reads the dependencies out of a Makefile-style depfile, as written by
+// `cc -MD -MF FILE':
+//
+//   out.o: src.cc some\ dir/a.h b.h
+//
+// with long lines continued by a backslash before the newline.
+// The contents are unescaped in place; `deps' points into `contents'.
+error parseDepfile(string* contents, vector<std::string_view>* deps) {
+  char* in = &(*contents)[0];
+  char* const end = in + contents->size();
+  bool seen_target = false;
+  while (in < end) {
+    // Skip whitespace and line continuations.
+    if (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') {
+      ++in;
+      continue;
+    }
+    if (*in == '\\' && in + 1 < end && (in[1] == '\n' || in[1] == '\r')) {
+      in += 2;
+      continue;
+    }
+    // One path, unescaped onto itself.
+    char* const start = in;
+    char* out = in;
+    for (; in < end; ++in) {
+      const char c = *in;
+      if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        break;
       }
-      Resolver* resolver = it->second.get();
-      error err1 = resolver->Resolve(target);
-      if (err1 != "") {
-        err += "[target=" + target + "] " + err1 + "\n";
+      if (c == '\\' && in + 1 < end &&
+          (in[1] == ' ' || in[1] == '\\' || in[1] == '#')) {
+        *out++ = *++in;
+      } else if (c == '$' && in + 1 < end && in[1] == '$') {
+        *out++ = *++in;
+      } else if (c == '\\' && in + 1 < end &&
+                 (in[1] == '\n' || in[1] == '\r')) {
+        break;
+      } else {
+        *out++ = c;
       }
     }
+    std::string_view path(start, static_cast<size_t>(out - start));
+    if (path.size() > 1 && path.back() == ':') {  // "out.o:"
+      seen_target = true;
+      continue;
+    }
+    if (path == ":") {  // "out.o :"
+      seen_target = true;
+      continue;
+    }
+    if (!seen_target) {
+      continue;  // Target without the colon yet.
+    }
+    deps->push_back(path);
   }
-  return err;
+  if (!seen_target) {
+    return "no target in depfile";
+  }
+  return "";
 }
 
-const string Manager::ListTargets() {
-  string s;
-  for (const auto& kv : rules_) {
-    const string& target = kv.first;
-    s += "  " + target + "\n";
+// The inputs each output was found to depend on the last time it was built,
+// as reported through depfiles.  Paths are interned into ids.  On disk it is a
+// log of records appended as outputs are rebuilt; each record is a 32-bit
+// header (high bit set for a path record, the rest the payload size)
+// followed by a 4-byte aligned payload:
+//   path record: the path, zero-padded.  Its id is the number of path records
+//                before it.
+//   deps record: the output's id followed by the ids of its inputs.
+class DepsLog {
+ public:
+  DepsLog() {}
+  ~DepsLog() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
   }
-  return s;
-}
 
-// Given a source file, say "hello/greet.cc" return the preferred target name,
-// i.e., "greet.hello" for that case.
-const string targetNameFromSource(const string& source) {
-  const string sourceSansExt = path::SansExt(source);
-  vector<string> chunks = strings::Split(sourceSansExt, '/');
-  std::reverse(chunks.begin(), chunks.end());
-  return strings::Join(chunks, ".");
-}
+  error Open(const string& path);
+  // Returns nullptr if there is no record for `output'.
+  const vector<uint32_t>* Deps(const string& output) const {
+    auto it = ids_.find(output);
+    if (it == ids_.end()) {
+      return nullptr;
+    }
+    auto it_deps = deps_.find(it->second);
+    return it_deps == deps_.end() ? nullptr : &it_deps->second;
+  }
+  const string& Path(uint32_t id) const { return paths_[id]; }
+  void Record(const string& output, const vector<std::string_view>& inputs);
 
-int main(int argc, char* argv[], char** envp) {
-  os::Runtime runtime(argc, argv, envp);
-  const vector<string>& targets = runtime.args();
+ private:
+  static constexpr char kMagic[8] = {'A', 'A', 'D', 'E', 'P', 0, 0, 1};
+  static constexpr uint32_t kPathRecord = 0x80000000;
+
+  // Returns the id of `path', appending a path record to `buffer' if it is
+  // new.
+  uint32_t intern(std::string_view path, string* buffer);
+  void appendDepsRecord(uint32_t output, const vector<uint32_t>& inputs,
+                        string* buffer);
+  static void appendU32(uint32_t x, string* buffer) {
+    buffer->append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
 
-  std::unique_ptr<eden::Node> global_attrs_root = eden::read(
-      strings::ReadFileToString(os::HomeDir() + "/.config/aa/defaults"));
+  vector<string> paths_;
+  map<string, uint32_t, std::less<>> ids_;
+  map<uint32_t, vector<uint32_t>> deps_;
+  int fd_ = -1;
+};
 
-  std::unique_ptr<Manager> m(new Manager(*global_attrs_root));
-  error err = m->Read();
-  if (err != "") {
-    std::cerr << err << "\n";
+uint32_t DepsLog::intern(std::string_view path, string* buffer) {
+  auto it = ids_.find(path);
+  if (it != ids_.end()) {
+    return it->second;
   }
-  if (targets.empty()) {
-    std::cout << m->ListTargets();
-    return 0;
+  const uint32_t id = static_cast<uint32_t>(paths_.size());
+  paths_.emplace_back(path);
+  ids_.emplace(paths_.back(), id);
+  const size_t padded = (path.size() + 4) & ~size_t{3};  // At least one \0.
+  appendU32(kPathRecord | static_cast<uint32_t>(padded), buffer);
+  buffer->append(path.data(), path.size());
+  buffer->append(padded - path.size(), '\0');
+  return id;
+}
+
+void DepsLog::appendDepsRecord(uint32_t output, const vector<uint32_t>& inputs,
+                               string* buffer) {
+  appendU32(static_cast<uint32_t>((inputs.size() + 1) * 4), buffer);
+  appendU32(output, buffer);
+  for (uint32_t input : inputs) {
+    appendU32(input, buffer);
   }
-  err = m->Resolve(targets);
+}
+
+error DepsLog::Open(const string& path) {
+  if (error err = path::MakeContainingDir(path); err != "") {
+    return err;
+  }
+  const string contents = strings::ReadFileToString(path);
+  size_t num_deps_records = 0;
+  if (contents.size() >= sizeof(kMagic) &&
+      contents.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) == 0) {
+    const char* p = contents.data() + sizeof(kMagic);
+    const char* const end = contents.data() + contents.size();
+    while (end - p >= 4) {
+      uint32_t header;
+      memcpy(&header, p, 4);
+      const size_t size = header & ~kPathRecord;
+      if (size % 4 != 0 || static_cast<size_t>(end - p - 4) < size) {
+        break;  // Truncated by an interrupted build; drop the tail.
+      }
+      p += 4;
+      if (header & kPathRecord) {
+        const std::string_view record(p, size);
+        const uint32_t id = static_cast<uint32_t>(paths_.size());
+        paths_.emplace_back(record.substr(0, record.find('\0')));
+        ids_.emplace(paths_.back(), id);
+      } else if (size >= 4) {
+        vector<uint32_t> ids(size / 4);
+        memcpy(ids.data(), p, size);
+        bool valid = true;
+        for (uint32_t id : ids) {
+          valid = valid && id < paths_.size();
+        }
+        if (valid) {
+          deps_[ids[0]].assign(ids.begin() + 1, ids.end());
+          ++num_deps_records;
+        }
+      }
+      p += size;
+    }
+  }
+  const bool rewrite = num_deps_records == 0 ||
+                       num_deps_records > 2 * deps_.size() + 1000;
+  if (!rewrite) {
+    fd_ = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    return fd_ == -1 ? "could not open " + path : "";
+  }
+  // Compact: re-intern only the paths that are still referenced.
+  vector<string> old_paths;
+  old_paths.swap(paths_);
+  map<uint32_t, vector<uint32_t>> old_deps;
+  old_deps.swap(deps_);
+  ids_.clear();
+  string data(kMagic, sizeof(kMagic));
+  for (const auto& kv : old_deps) {
+    const uint32_t output = intern(old_paths[kv.first], &data);
+    vector<uint32_t> inputs;
+    inputs.reserve(kv.second.size());
+    for (uint32_t id : kv.second) {
+      inputs.push_back(intern(old_paths[id], &data));
+    }
+    appendDepsRecord(output, inputs, &data);
+    deps_[output] = std::move(inputs);
+  }
+  const string tmp = path + ".tmp";
+  fd_ = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    return "could not create " + tmp;
+  }
+  if (write(fd_, data.data(), data.size()) !=
+          static_cast<ssize_t>(data.size()) ||
+      rename(tmp.c_str(), path.c_str()) != 0) {
+    close(fd_);
+    fd_ = -1;
+    return "could not write " + path;
+  }
+  return "";
+}
+
+void DepsLog::Record(const string& output,
+                     const vector<std::string_view>& inputs) {
+  string buffer;
+  const uint32_t output_id = intern(output, &buffer);
+  vector<uint32_t> input_ids;
+  input_ids.reserve(inputs.size());
+  for (std::string_view input : inputs) {
+    input_ids.push_back(intern(input, &buffer));
+  }
+  vector<uint32_t>& deps = deps_[output_id];
+  if (deps == input_ids && buffer.empty()) {
+    return;  // Nothing new.
+  }
+  deps = std::move(input_ids);
+  appendDepsRecord(output_id, deps, &buffer);
+  if (fd_ != -1 &&
+      write(fd_, buffer.data(), buffer.size()) !=
+          static_cast<ssize_t>(buffer.size())) {
+    std::cerr << "aa: could not append to the deps log\n";
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+// Caches stat() results.  Within a build, whoever writes a file invalidates
+// it.  Between builds (in the server) the cache stays valid only for files
+// whose directories are watched with inotify, and the events invalidate what
+// changed on disk.
+class FileStates {
+ public:
+  FileStates() {}
+  ~FileStates() {
+    if (inotify_fd_ != -1) {
+      close(inotify_fd_);
+    }
+  }
+
+  // Starts watching the directories of the files looked up from now on.
+  // Returns the inotify fd to poll for ProcessEvents(), or -1.
+  int Watch() {
+    mtimes_.clear();
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return inotify_fd_;
+  }
+  bool Watching() const { return inotify_fd_ != -1; }
+  int fd() const { return inotify_fd_; }
+  // Drains pending inotify events without blocking.  Returns the files that
+  // changed among those looked up before, except the ones the build itself
+  // writes.  A lost event queue is reported as a single "".
+  vector<string> ProcessEvents();
+
+  int64_t ModTime(const string& path);
+  // Called for the files the build writes.
+  void Written(const string& path) {
+    mtimes_.erase(path);
+    written_.insert(path);
+  }
+
+ private:
+  static const uint32_t kEvents = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+      IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+      IN_MOVE_SELF;
+
+  std::unordered_map<string, int64_t> mtimes_;
+  std::unordered_set<string> written_;
+  int inotify_fd_ = -1;
+  // "dir/" (or "" for the current directory) -> watch descriptor, and back.
+  // Different spellings of a directory share a descriptor.
+  map<string, int> watches_;
+  map<int, vector<string>> dirs_by_watch_;
+};
+
+int64_t FileStates::ModTime(const string& path) {
+  auto it = mtimes_.find(path);
+  if (it != mtimes_.end()) {
+    return it->second;
+  }
+  if (inotify_fd_ != -1) {
+    // Watch before stat'ing, so that no change can slip in between.
+    const string dir = path.substr(0, path.rfind('/') + 1);
+    if (watches_.find(dir) == watches_.end()) {
+      const int wd = inotify_add_watch(inotify_fd_,
+                                       dir.empty() ? "." : dir.c_str(),
+                                       kEvents);
+      if (wd == -1) {
+        return os::ModTime(path);  // E.g., no such directory; don't cache.
+      }
+      watches_[dir] = wd;
+      dirs_by_watch_[wd].push_back(dir);
+    }
+  }
+  const int64_t t = os::ModTime(path);
+  mtimes_[path] = t;
+  return t;
+}
+
+vector<string> FileStates::ProcessEvents() {
+  vector<string> changed;
+  if (inotify_fd_ == -1) {
+    return changed;
+  }
+  alignas(struct inotify_event) char buffer[1 << 16];
+  ssize_t n;
+  while ((n = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < n;) {
+      struct inotify_event event;
+      memcpy(&event, buffer + i, sizeof(event));
+      const char* name = buffer + i + sizeof(event);
+      i += static_cast<ssize_t>(sizeof(event) + event.len);
+      if (event.mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF |
+                        IN_MOVE_SELF)) {
+        // Lost track; forget everything, watches included.
+        if (!mtimes_.empty()) {
+          changed.push_back("");
+        }
+        mtimes_.clear();
+        for (const auto& kv : dirs_by_watch_) {
+          inotify_rm_watch(inotify_fd_, kv.first);
+        }
+        watches_.clear();
+        dirs_by_watch_.clear();
+        continue;
+      }
+      if (event.len == 0) {
+        continue;
+      }
+      auto it = dirs_by_watch_.find(event.wd);
+      if (it == dirs_by_watch_.end()) {
+        continue;
+      }
+      for (const string& dir : it->second) {
+        const string path = dir + name;
+        if (mtimes_.erase(path) > 0 && written_.count(path) == 0) {
+          changed.push_back(path);
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+// An action is up to date if all its outputs exist, none of them is older
+// than any of its inputs (including the ones its depfile reported last time),
+// and they were produced by the very same command line.
+bool upToDate(const Action& action, uint64_t fingerprint, const BuildLog& log,
+              const DepsLog& deps_log, FileStates* files) {
+  // Look at every input even once the answer is known: for the server and for
+  // --watch, looking at a file is what gets it watched.
+  int64_t newest_input = -1;
+  bool missing_input = false;
+  auto lookAt = [&](const string& input) {
+    const int64_t t = files->ModTime(input);
+    missing_input = missing_input || t == -1;
+    newest_input = std::max(newest_input, t);
+  };
+  for (const string& input : action.inputs) {
+    lookAt(input);
+  }
+  const vector<uint32_t>* deps = nullptr;
+  if (!action.depfile.empty() && !action.outputs.empty()) {
+    deps = deps_log.Deps(action.outputs[0]);
+    if (deps == nullptr) {
+      return false;  // Without the discovered inputs we cannot tell.
+    }
+    for (uint32_t id : *deps) {
+      lookAt(deps_log.Path(id));
+    }
+  }
+  if (missing_input || action.outputs.empty()) {
+    return false;
+  }
+  for (const string& output : action.outputs) {
+    if (!log.Matches(output, fingerprint)) {
+      return false;
+    }
+    const int64_t t = files->ModTime(output);
+    if (t == -1 || t < newest_input) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Content-addressed store of action outputs, in the spirit of git's object
+// store.  An action's key hashes everything that can affect its output: the
+// command line, the identity of the program it runs, and the path and
+// contents of every input, including the ones its depfile reported.  Blobs
+// live at DIR/objects/ab/cdef...; outputs go in with hard links, so an insert
+// costs no copying at all, and come out as reflinks where the filesystem has
+// them.  Not hard links: a hit is touched, and the blob, and every other
+// checkout's link to it, would be touched with it.
+//
+// The headers an action reads are only known once it has run, and the
+// DepsLog that records them belongs to one checkout.  So, as in ccache's
+// direct mode, inserting such an action also stores a manifest blob listing
+// them, keyed by what is known up front (the command line, the program and
+// the explicit inputs).  A lookup reads the manifest and hashes the headers
+// it lists, which works just as well in a fresh checkout.  Each manifest
+// keeps only the latest list; the list changes only when the contents of the
+// hashed files do, and then so does the key.
+//
+// DIR is meant to be shared by every checkout on the machine, and by builds
+// running at the same time.  Blobs are inserted under a temporary name and
+// renamed into place.  Every insert and hit appends a (key, size, time)
+// record to DIR/index under a shared lock on DIR/lock; an eviction pass runs
+// in the background while the build goes on, takes the lock exclusively,
+// drops the least recently used blobs until the store fits in `max_bytes',
+// and rewrites the index.  Nothing ever scans DIR/objects.
+class ObjectStore {
+ public:
+  // `max_bytes' == 0 means the store may grow without bounds.
+  ObjectStore(const string& dir, uint64_t max_bytes);
+  ~ObjectStore() {
+    if (lock_fd_ != -1) {
+      close(lock_fd_);
+    }
+  }
+
+  // Replaces the output of `action' with its blob, if there is one, and
+  // records the inputs its manifest lists in `deps_log'.  Actions the store
+  // can never serve (not cacheable) count as uncacheable, every other one
+  // not served this way as a miss.
+  bool Fetch(const Action& action, uint64_t fingerprint, DepsLog* deps_log);
+  // Stores the output of `action', which has just run, along with the
+  // manifest of the inputs its depfile reported (as now in `deps_log').
+  void Insert(const Action& action, uint64_t fingerprint,
+              const DepsLog& deps_log);
+
+  // Forks the eviction pass, if the store has a size limit and may have
+  // outgrown it since the last pass.
+  void StartEviction();
+  // Waits for the eviction pass and returns a one-line summary of hits,
+  // misses, uncacheable actions and evictions, or "" if the store was not
+  // used at all.
+  string FinishAndSummarize();
+
+ private:
+  struct IndexRecord {
+    uint64_t key;
+    uint64_t size;
+    int64_t atime;  // Seconds since the epoch.
+  };
+
+  string blobPath(uint64_t key) const {
+    const string hex = strings::Hex(key);
+    return dir_ + "objects/" + hex.substr(0, 2) + "/" + hex.substr(2);
+  }
+  // Hashes into `key' what is known about `action' before it runs.  Returns
+  // false if the action is not cacheable or an input is missing.
+  bool manifestKey(const Action& action, uint64_t fingerprint,
+                   uint64_t* key) const;
+  // Returns false if the key cannot be computed, e.g., because an input is
+  // missing or there is no manifest yet.  `manifest' gets the paths the
+  // manifest lists; `manifest_key' is left 0 for an action without a depfile.
+  bool objectKey(const Action& action, uint64_t fingerprint,
+                 uint64_t* manifest_key, vector<string>* manifest,
+                 uint64_t* key) const;
+  // Moves `tmp' into place as the blob for `key'.
+  void put(uint64_t key, const string& tmp);
+  void noteAccess(uint64_t key, const string& blob);
+  // Whether the blobs the last eviction pass left, plus all those recorded
+  // in the index since (counted again when used again), exceed max_bytes_.
+  // The pass leaves the index size and blob bytes it ended with in
+  // DIR/evicted.
+  bool mayBeOverBudget() const;
+  // Runs in the eviction process.  Returns the number of blobs and bytes
+  // evicted.
+  pair<uint64_t, uint64_t> evict();
+
+  const string dir_;
+  const uint64_t max_bytes_;
+  int lock_fd_ = -1;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t uncacheable_ = 0;
+  pid_t eviction_pid_ = -1;
+  int eviction_fd_ = -1;  // Read end of the pipe the eviction reports on.
+};
+
+ObjectStore::ObjectStore(const string& dir, uint64_t max_bytes)
+    : dir_(dir), max_bytes_(max_bytes) {
+  const string lock = dir_ + "lock";
+  if (path::MakeContainingDir(lock) == "") {
+    lock_fd_ = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  }
+}
+
+// Folds the path and contents of `path' into `h'.
+bool hashInput(const string& path, uint64_t* h) {
+  *h = strings::Hash(path.c_str(), path.size() + 1, *h);
+  return strings::HashFile(path, h);
+}
+
+// Manifests list one path per line.
+vector<string> splitManifest(const string& manifest) {
+  vector<string> paths;
+  for (size_t begin = 0, end; begin < manifest.size(); begin = end + 1) {
+    end = manifest.find('\n', begin);
+    if (end == string::npos) {
+      end = manifest.size();
+    }
+    paths.emplace_back(manifest, begin, end - begin);
+  }
+  return paths;
+}
+
+bool ObjectStore::manifestKey(const Action& action, uint64_t fingerprint,
+                              uint64_t* key) const {
+  if (!action.cacheable || action.outputs.size() != 1) {
+    return false;
+  }
+  struct stat st;
+  if (stat(action.program.c_str(), &st) != 0) {
+    return false;
+  }
+  uint64_t h = strings::Hash(reinterpret_cast<const char*>(&fingerprint),
+                             sizeof(fingerprint));
+  const int64_t program_id[] = {static_cast<int64_t>(st.st_size),
+                                st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+  h = strings::Hash(reinterpret_cast<const char*>(program_id),
+                    sizeof(program_id), h);
+  for (const string& input : action.inputs) {
+    if (!hashInput(input, &h)) {
+      return false;
+    }
+  }
+  *key = h;
+  return true;
+}
+
+bool ObjectStore::objectKey(const Action& action, uint64_t fingerprint,
+                            uint64_t* manifest_key, vector<string>* manifest,
+                            uint64_t* key) const {
+  uint64_t h;
+  if (!manifestKey(action, fingerprint, &h)) {
+    return false;
+  }
+  *manifest_key = 0;
+  if (!action.depfile.empty()) {
+    *manifest_key = h;
+    const string text = strings::ReadFileToString(blobPath(h));
+    if (text.empty()) {
+      return false;
+    }
+    h = strings::Hash(text, h);
+    *manifest = splitManifest(text);
+    for (const string& path : *manifest) {
+      if (!hashInput(path, &h)) {
+        return false;
+      }
+    }
+  }
+  *key = h;
+  return true;
+}
+
+bool ObjectStore::Fetch(const Action& action, uint64_t fingerprint,
+                        DepsLog* deps_log) {
+  if (!action.cacheable || action.outputs.size() != 1) {
+    ++uncacheable_;
+    return false;
+  }
+  uint64_t manifest_key, key;
+  vector<string> manifest;
+  if (!objectKey(action, fingerprint, &manifest_key, &manifest, &key)) {
+    ++misses_;
+    return false;
+  }
+  const string blob = blobPath(key);
+  const string& output = action.outputs[0];
+  if (access(blob.c_str(), R_OK) != 0 ||
+      path::MakeContainingDir(output) != "") {
+    ++misses_;
+    return false;
+  }
+  unlink(output.c_str());
+  // The blob keeps its old mtime; touch the copy so that whatever depends on
+  // the output sees it as new.
+  if (!os::CloneOrCopy(blob, output) || !os::Touch(output)) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  noteAccess(key, blob);
+  if (manifest_key != 0) {
+    noteAccess(manifest_key, blobPath(manifest_key));
+    deps_log->Record(output, vector<std::string_view>(manifest.begin(),
+                                                      manifest.end()));
+  }
+  return true;
+}
+
+void ObjectStore::Insert(const Action& action, uint64_t fingerprint,
+                         const DepsLog& deps_log) {
+  uint64_t key;
+  if (!manifestKey(action, fingerprint, &key)) {
+    return;
+  }
+  // Blobs go in under a temporary name first so that concurrent builds never
+  // see one partially written.
+  const string suffix = ".tmp" + std::to_string(getpid());
+  if (!action.depfile.empty()) {
+    const vector<uint32_t>* deps = deps_log.Deps(action.outputs[0]);
+    if (deps == nullptr) {
+      return;
+    }
+    string manifest;
+    for (uint32_t id : *deps) {
+      manifest += deps_log.Path(id);
+      manifest += '\n';
+    }
+    const uint64_t manifest_key = key;
+    key = strings::Hash(manifest, key);
+    for (uint32_t id : *deps) {
+      if (!hashInput(deps_log.Path(id), &key)) {
+        return;
+      }
+    }
+    // Rewritten every time: the headers may have changed since.
+    const string tmp = blobPath(manifest_key) + suffix;
+    if (path::MakeContainingDir(tmp) != "") {
+      return;
+    }
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+    if (fd == -1) {
+      return;
+    }
+    const bool ok =
+        write(fd, manifest.data(), manifest.size()) ==
+            static_cast<ssize_t>(manifest.size());
+    if (close(fd) != 0 || !ok) {
+      unlink(tmp.c_str());
+      return;
+    }
+    put(manifest_key, tmp);
+  }
+  const string blob = blobPath(key);
+  if (access(blob.c_str(), F_OK) == 0 ||
+      path::MakeContainingDir(blob) != "") {
+    return;
+  }
+  const string tmp = blob + suffix;
+  if (os::LinkOrCopy(action.outputs[0], tmp)) {
+    put(key, tmp);
+  }
+}
+
+void ObjectStore::put(uint64_t key, const string& tmp) {
+  const string blob = blobPath(key);
+  if (rename(tmp.c_str(), blob.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+  noteAccess(key, blob);
+}
+
+void ObjectStore::noteAccess(uint64_t key, const string& blob) {
+  struct stat st;
+  if (lock_fd_ == -1 || stat(blob.c_str(), &st) != 0) {
+    return;
+  }
+  const IndexRecord r{key, static_cast<uint64_t>(st.st_size), time(nullptr)};
+  flock(lock_fd_, LOCK_SH);
+  const string index = dir_ + "index";
+  int fd = open(index.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    if (write(fd, &r, sizeof(r)) != sizeof(r)) {
+      std::cerr << "aa: could not append to " << index << "\n";
+    }
+    close(fd);
+  }
+  flock(lock_fd_, LOCK_UN);
+}
+
+pair<uint64_t, uint64_t> ObjectStore::evict() {
+  flock(lock_fd_, LOCK_EX);
+  const string index = dir_ + "index";
+  const string contents = strings::ReadFileToString(index);
+  const size_t num_records = contents.size() / sizeof(IndexRecord);
+  map<uint64_t, IndexRecord> latest;
+  for (size_t i = 0; i < num_records; ++i) {
+    IndexRecord r;
+    memcpy(&r, contents.data() + i * sizeof(r), sizeof(r));
+    IndexRecord& l = latest[r.key];
+    if (r.atime >= l.atime) {
+      l = r;
+    }
+  }
+  uint64_t total = 0;
+  for (const auto& kv : latest) {
+    total += kv.second.size;
+  }
+  uint64_t evicted = 0;
+  uint64_t evicted_bytes = 0;
+  if (total > max_bytes_) {
+    // Evict down to 90% of the budget so that we don't do it again right
+    // away.
+    const uint64_t target = max_bytes_ / 10 * 9;
+    vector<IndexRecord> by_age;
+    by_age.reserve(latest.size());
+    for (const auto& kv : latest) {
+      by_age.push_back(kv.second);
+    }
+    std::sort(by_age.begin(), by_age.end(),
+              [](const IndexRecord& a, const IndexRecord& b) {
+                return a.atime < b.atime;
+              });
+    for (const IndexRecord& r : by_age) {
+      if (total <= target) {
+        break;
+      }
+      if (unlink(blobPath(r.key).c_str()) == 0) {
+        ++evicted;
+        evicted_bytes += r.size;
+      }
+      total -= r.size;
+      latest.erase(r.key);
+    }
+  }
+  uint64_t index_size = num_records * sizeof(IndexRecord);
+  if (evicted > 0 || num_records > 2 * latest.size() + 1000) {
+    string data;
+    data.reserve(latest.size() * sizeof(IndexRecord));
+    for (const auto& kv : latest) {
+      data.append(reinterpret_cast<const char*>(&kv.second),
+                  sizeof(IndexRecord));
+    }
+    const string tmp = index + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+      const bool ok = write(fd, data.data(), data.size()) ==
+                      static_cast<ssize_t>(data.size());
+      if (close(fd) != 0 || !ok || rename(tmp.c_str(), index.c_str()) != 0) {
+        unlink(tmp.c_str());
+      } else {
+        index_size = data.size();
+      }
+    }
+  }
+  const uint64_t mark[] = {index_size, total};
+  const string mark_file = dir_ + "evicted";
+  const int fd = open(mark_file.c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    const bool ok = write(fd, mark, sizeof(mark)) == sizeof(mark);
+    if (close(fd) != 0 || !ok) {
+      unlink(mark_file.c_str());  // The next build runs a pass.
+    }
+  }
+  flock(lock_fd_, LOCK_UN);
+  return make_pair(evicted, evicted_bytes);
+}
+
+bool ObjectStore::mayBeOverBudget() const {
+  uint64_t mark[2];
+  const string text = strings::ReadFileToString(dir_ + "evicted");
+  if (text.size() != sizeof(mark)) {
+    return true;
+  }
+  memcpy(mark, text.data(), sizeof(mark));
+  const int fd = open((dir_ + "index").c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) < mark[0]) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return true;  // Rewritten by someone else; let the pass sort it out.
+  }
+  string tail(static_cast<uint64_t>(st.st_size) - mark[0], '\0');
+  const ssize_t n = pread(fd, &tail[0], tail.size(),
+                          static_cast<off_t>(mark[0]));
+  close(fd);
+  if (n < 0) {
+    return true;
+  }
+  uint64_t total = mark[1];
+  for (size_t i = 0; i + sizeof(IndexRecord) <= static_cast<size_t>(n);
+       i += sizeof(IndexRecord)) {
+    IndexRecord r;
+    memcpy(&r, tail.data() + i, sizeof(r));
+    total += r.size;
+  }
+  return total > max_bytes_;
+}
+
+void ObjectStore::StartEviction() {
+  int fds[2];
+  if (max_bytes_ == 0 || lock_fd_ == -1 || !mayBeOverBudget() ||
+      pipe2(fds, O_CLOEXEC) != 0) {
+    return;
+  }
+  eviction_pid_ = fork();
+  if (eviction_pid_ == 0) {
+    close(fds[0]);
+    // flock() locks belong to the open file, which is shared with the parent
+    // after fork(); get our own.
+    close(lock_fd_);
+    lock_fd_ = open((dir_ + "lock").c_str(), O_RDWR | O_CLOEXEC);
+    if (lock_fd_ == -1) {
+      _exit(1);
+    }
+    const pair<uint64_t, uint64_t> evicted = evict();
+    const uint64_t report[] = {evicted.first, evicted.second};
+    _exit(write(fds[1], report, sizeof(report)) == sizeof(report) ? 0 : 1);
+  }
+  close(fds[1]);
+  if (eviction_pid_ == -1) {
+    close(fds[0]);
+    return;
+  }
+  eviction_fd_ = fds[0];
+}
+
+string ObjectStore::FinishAndSummarize() {
+  uint64_t report[] = {0, 0};
+  if (eviction_fd_ != -1) {
+    // The pass writes its report just before it exits, so this also waits
+    // for it to finish.
+    ssize_t n;
+    while ((n = read(eviction_fd_, report, sizeof(report))) == -1 &&
+           errno == EINTR) {
+    }
+    if (n != sizeof(report)) {
+      report[0] = report[1] = 0;
+    }
+    close(eviction_fd_);
+    eviction_fd_ = -1;
+    waitpid(eviction_pid_, nullptr, 0);
+  }
+  if (hits_ == 0 && misses_ == 0 && uncacheable_ == 0 && report[0] == 0) {
+    return "";
+  }
+  return "cache: " + std::to_string(hits_) + " hits, " +
+         std::to_string(misses_) + " misses, " +
+         std::to_string(uncacheable_) + " uncacheable, " +
+         std::to_string(report[0]) + " evicted (" +
+         std::to_string(report[1] >> 20) + " MiB)\n";
+}
+
+// What a build remembers about earlier builds, loaded once per process (and
+// thus kept warm by the server).
+struct BuildState {
+  BuildLog log;
+  DepsLog deps_log;
+  FileStates files;
+  bool opened = false;
+
+  void Open(const string& outDir) {
+    if (opened) {
+      return;
+    }
+    opened = true;
+    if (error err = log.Open(outDir + ".aa_log"); err != "") {
+      std::cerr << "aa: " << err << "; everything will be rebuilt\n";
+    }
+    if (error err = deps_log.Open(outDir + ".aa_deps"); err != "") {
+      std::cerr << "aa: " << err << "; everything will be rebuilt\n";
+    }
+  }
+};
+
+// The part of the target graph reachable from the requested targets, in the
+// shape the Executor needs.  Targets are numbered from 0 in the order of their
+// `names'.  Given the digraph F in which x->y means y should be resolved
+// before x, `rdepends' is the reverse digraph (y->x), `pending_deps' counts
+// the unresolved dependencies of each target (the in-degree in F), and
+// `priority' is the number of targets on the longest path from a target up to
+// one of the requested targets.  Targets with a higher priority head longer
+// chains and should start first.
+struct TargetGraph {
+  vector<string> names;
+  vector<vector<size_t>> rdepends;
+  vector<size_t> pending_deps;
+  vector<size_t> priority;
+};
+
+pair<error, TargetGraph> buildTargetGraph(const set<string>& targets,
+                                          const map<string, set<string>>& F) {
+  // The targets of F, numbered in order.  Only the dependencies of those
+  // reached are looked up.
+  vector<const pair<const string, set<string>>*> rules;
+  std::unordered_map<std::string_view, size_t> numbers;
+  rules.reserve(F.size());
+  numbers.reserve(F.size());
+  for (const auto& kv : F) {
+    numbers.emplace(kv.first, rules.size());
+    rules.push_back(&kv);
+  }
+  const auto missing = [](const string& target) {
+    return make_pair("Couldn't find node " + target + " in rules.",
+                     TargetGraph());
+  };
+
+  // Depth-first walk over F.  Targets `visiting' are on the current path, so
+  // reaching one of them again means a cycle.
+  enum : uint8_t { kUnseen, kVisiting, kVisited };
+  vector<uint8_t> state(rules.size(), kUnseen);
+  vector<vector<size_t>> deps(rules.size());
+  vector<pair<size_t, set<string>::const_iterator>> stack;
+  for (const string& root : targets) {
+    auto found = numbers.find(root);
+    if (found == numbers.end()) {
+      return missing(root);
+    }
+    if (state[found->second] != kUnseen) {
+      continue;
+    }
+    state[found->second] = kVisiting;
+    deps[found->second].reserve(rules[found->second]->second.size());
+    stack.emplace_back(found->second, rules[found->second]->second.cbegin());
+    while (!stack.empty()) {
+      const size_t target = stack.back().first;
+      auto& it = stack.back().second;
+      if (it == rules[target]->second.cend()) {
+        state[target] = kVisited;
+        stack.pop_back();
+        continue;
+      }
+      const string& dep_name = *it++;
+      if (found = numbers.find(dep_name); found == numbers.end()) {
+        return missing(dep_name);
+      }
+      const size_t dep = found->second;
+      deps[target].push_back(dep);
+      if (state[dep] == kVisiting) {
+        return make_pair("Dependency cycle through " + dep_name + " and " +
+                             rules[target]->first,
+                         TargetGraph());
+      }
+      if (state[dep] == kUnseen) {
+        state[dep] = kVisiting;
+        deps[dep].reserve(rules[dep]->second.size());
+        stack.emplace_back(dep, rules[dep]->second.cbegin());
+      }
+    }
+  }
+
+  // Renumber what was reached, still in order, and reverse the edges.
+  TargetGraph graph;
+  vector<size_t> ids(rules.size());
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (state[i] == kVisited) {
+      ids[i] = graph.names.size();
+      graph.names.push_back(rules[i]->first);
+    }
+  }
+  const size_t n = graph.names.size();
+  graph.rdepends.resize(n);
+  graph.pending_deps.resize(n);
+  graph.priority.resize(n);
+  vector<vector<size_t>> depends(n);
+  vector<size_t> unranked_dependents(n);
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (state[i] == kVisited) {
+      for (size_t& dep : deps[i]) {
+        dep = ids[dep];
+        ++unranked_dependents[dep];
+      }
+      graph.pending_deps[ids[i]] = deps[i].size();
+      depends[ids[i]] = std::move(deps[i]);
+    }
+  }
+  vector<size_t> ranked;
+  ranked.reserve(n);
+  for (size_t target = 0; target < n; ++target) {
+    graph.rdepends[target].reserve(unranked_dependents[target]);
+    if (unranked_dependents[target] == 0) {
+      ranked.push_back(target);
+    }
+  }
+  for (size_t target = 0; target < n; ++target) {
+    for (size_t dep : depends[target]) {
+      graph.rdepends[dep].push_back(target);
+    }
+  }
+
+  // A target's priority is known once the priorities of all its dependents
+  // are, so rank in topological order of the reverse graph, starting from
+  // the targets nothing depends on.
+  for (size_t i = 0; i < ranked.size(); ++i) {
+    const size_t target = ranked[i];
+    size_t priority = 1;
+    for (size_t dependent : graph.rdepends[target]) {
+      priority = std::max(priority, graph.priority[dependent] + 1);
+    }
+    graph.priority[target] = priority;
+    for (size_t dep : depends[target]) {
+      if (--unranked_dependents[dep] == 0) {
+        ranked.push_back(dep);
+      }
+    }
+  }
+  return make_pair("", std::move(graph));
+}
+
+// Runs the actions of the targets in a TargetGraph with at most `jobs'
+// subprocesses alive at any time.  There are no phases: a target becomes ready
+// the moment its last dependency finishes, and the ready target with the
+// highest priority goes first.  The actions of one target run one after the
+// other, skipping the ones that are up to date and taking the outputs from the
+// ObjectStore when possible.  A failing target cancels the rest of its actions
+// and everything that depends on it.
+class Executor {
+ public:
+  Executor(size_t jobs, TargetGraph graph, const Rules& rules,
+           BuildState* state, ObjectStore* store)
+      : jobs_(jobs < 1 ? 1 : jobs), graph_(std::move(graph)), rules_(rules),
+        log_(&state->log), deps_log_(&state->deps_log), files_(&state->files),
+        store_(store), queued_(graph_.names.size()),
+        failed_(graph_.names.size()) {}
+  ~Executor() {}
+
+  // Makes Run() cancel the actions whose inputs change on disk while they
+  // run, and add the files that changed to `*changes'.  Needs a FileStates
+  // that is Watching().
+  void CancelOnChange(set<string>* changes) {
+    changes_ = changes;
+    spawner_.Watch(files_->fd());
+  }
+
+  // Returns one "[target=...] ..." line per failed or skipped target.
+  error Run();
+
+  // What each action that ran cost, in the order they finished.
+  struct ActionUsage {
+    string target;
+    string kind;
+    int64_t wall_us;
+    os::Usage usage;
+  };
+  const vector<ActionUsage>& Usages() const { return usages_; }
+
+ private:
+  struct Job {
+    vector<Action> actions;
+    vector<uint64_t> fingerprints;  // Of the actions started so far.
+    size_t next = 0;  // Index of the action to start next.
+    size_t running = 0;
+    bool failed = false;  // Waiting for `running' actions to end.
+  };
+
+  // Ready queue entry: priority and target.  Higher priority first, then
+  // alphabetical, which is the order of the targets' numbers.
+  typedef pair<size_t, size_t> Ready;
+  struct ReadyOrder {
+    bool operator()(const Ready& a, const Ready& b) const {
+      return a.first != b.first ? a.first < b.first : a.second > b.second;
+    }
+  };
+
+  // Targets are numbered as in graph_.
+  void makeReady(size_t target);
+  // Starts the next action of `target', planning it first if needed, unless
+  // it has to wait for actions of an earlier stage.
+  void start(size_t target);
+  void finish(size_t target);
+  void fail(size_t target, const error& err);
+  // Blocks until some running action finishes (or, with CancelOnChange(),
+  // files change) and handles that.
+  void wait();
+  // Handles the end of a running action.
+  void complete(const os::Spawner::Finished& finished);
+  void cancelStale(const vector<string>& changed);
+
+  const size_t jobs_;
+  TargetGraph graph_;
+  const Rules& rules_;
+  BuildLog* log_;
+  DepsLog* deps_log_;
+  FileStates* files_;
+  ObjectStore* store_;  // Optional.
+  size_t num_run_ = 0;
+  size_t num_fetched_ = 0;
+  std::priority_queue<Ready, vector<Ready>, ReadyOrder> ready_;
+  vector<bool> queued_;  // The targets in ready_.
+  // Targets that failed or were skipped; start() drops their stale entries
+  // in ready_.
+  vector<bool> failed_;
+  map<size_t, Job> jobs_by_target_;
+  struct Running {
+    size_t target;
+    size_t action;  // Index into the Job's actions.
+    bool cancelled;
+    size_t slot;  // 1-based worker slot, the action's track in the trace.
+    int64_t begin_us;
+  };
+  map<pid_t, Running> running_;
+  os::Spawner spawner_;
+  set<string>* changes_ = nullptr;
+  vector<bool> busy_slots_;
+  vector<ActionUsage> usages_;
+  error err_;
+};
+
+void Executor::makeReady(size_t target) {
+  if (!queued_[target]) {
+    queued_[target] = true;
+    ready_.emplace(graph_.priority[target], target);
+  }
+}
+
+void Executor::start(size_t target) {
+  queued_[target] = false;
+  if (failed_[target]) {
+    return;
+  }
+  const string& name = graph_.names[target];
+  auto it_job = jobs_by_target_.find(target);
+  if (it_job == jobs_by_target_.end()) {
+    Job job;
+    if (auto it = rules_.find(name); it != rules_.end()) {
+      error err = it->second->Resolve(name, &job.actions);
+      if (err != "") {
+        fail(target, err);
+        return;
+      }
+      for (const Action& action : job.actions) {
+        for (const string& file : action.generated) {
+          files_->Written(file);
+        }
+      }
+    }
+    it_job = jobs_by_target_.emplace(target, std::move(job)).first;
+  }
+  Job& job = it_job->second;
+  if (job.failed) {
+    return;
+  }
+  for (; job.next < job.actions.size(); ++job.next) {
+    const Action& action = job.actions[job.next];
+    if (job.running > 0 &&
+        action.stage != job.actions[job.next - 1].stage) {
+      return;  // complete() makes it ready again.
+    }
+    const uint64_t fingerprint = BuildLog::Fingerprint(action);
+    job.fingerprints.push_back(fingerprint);
+    bool up_to_date;
+    {
+      TraceSpan span("up-to-date check", {{"target", name}});
+      up_to_date = upToDate(action, fingerprint, *log_, *deps_log_, files_);
+    }
+    if (up_to_date) {
+      continue;
+    }
+    TraceSpan span("object store lookup", {{"target", name}});
+    if (store_ != nullptr &&
+        store_->Fetch(action, fingerprint, deps_log_)) {
+      files_->Written(action.outputs[0]);
+      std::cout << "  " << action.message << " (cached)\n";
+      ++num_fetched_;
+      log_->Record(action.outputs[0], fingerprint);
+      continue;
+    }
+    break;
+  }
+  if (job.next == job.actions.size()) {
+    if (job.running == 0) {
+      finish(target);
+    }
+    return;
+  }
+  const size_t index = job.next++;
+  const Action& action = job.actions[index];
+  ++num_run_;
+  std::cout << "  " << action.message << "\n" << std::flush;
+  // Outputs may be hard links into the ObjectStore; never write through them.
+  for (const string& output : action.outputs) {
+    unlink(output.c_str());
+    path::MakeContainingDir(output);
+    files_->Written(output);
+  }
+  pid_t pid = spawner_.Start(action.program, action.args);
+  if (pid == -1) {
+    fail(target, "[" + action.kind + "] could not start " + action.program);
+    return;
+  }
+  ++job.running;
+  if (running_.size() + 1 < jobs_ && job.next < job.actions.size() &&
+      job.actions[job.next].stage == action.stage) {
+    makeReady(target);  // The next one can start right away, too.
+  }
+  size_t slot = 0;
+  while (slot < busy_slots_.size() && busy_slots_[slot]) {
+    ++slot;
+  }
+  if (slot == busy_slots_.size()) {
+    busy_slots_.push_back(true);
+  }
+  busy_slots_[slot] = true;
+  running_.emplace(pid, Running{target, index, false, slot + 1,
+                                os::NowMicros()});
+}
+
+void Executor::finish(size_t target) {
+  jobs_by_target_.erase(target);
+  for (size_t dependent : graph_.rdepends[target]) {
+    if (--graph_.pending_deps[dependent] == 0) {
+      makeReady(dependent);
+    }
+  }
+}
+
+void Executor::fail(size_t target, const error& err) {
+  failed_[target] = true;
+  queued_[target] = false;
+  if (auto it = jobs_by_target_.find(target); it != jobs_by_target_.end()) {
+    if (it->second.running > 0) {
+      it->second.failed = true;  // complete() cleans up.
+    } else {
+      jobs_by_target_.erase(it);
+    }
+  }
+  const string& name = graph_.names[target];
+  err_ += "[target=" + name + "] " + err + "\n";
+  for (size_t dependent : graph_.rdepends[target]) {
+    // Only report each skipped target once, for its first failed dependency.
+    if (graph_.pending_deps[dependent] != 0) {
+      graph_.pending_deps[dependent] = 0;
+      fail(dependent, "skipped, dependency " + name + " failed");
+    }
+  }
+}
+
+void Executor::wait() {
+  vector<os::Spawner::Finished> finished;
+  if (spawner_.Wait(-1, &finished) && changes_ != nullptr) {
+    cancelStale(files_->ProcessEvents());
+  }
+  for (const os::Spawner::Finished& f : finished) {
+    complete(f);
+  }
+}
+
+void Executor::cancelStale(const vector<string>& changed) {
+  if (changed.empty()) {
+    return;
+  }
+  changes_->insert(changed.begin(), changed.end());
+  const bool everything = changes_->count("") > 0;
+  for (auto& kv : running_) {
+    Running& running = kv.second;
+    const Action& action =
+        jobs_by_target_.at(running.target).actions[running.action];
+    bool stale = everything;
+    for (const string& input : action.inputs) {
+      stale = stale || changes_->count(input) > 0;
+    }
+    if (!action.depfile.empty()) {
+      if (const vector<uint32_t>* deps = deps_log_->Deps(action.outputs[0]);
+          deps != nullptr) {
+        for (uint32_t id : *deps) {
+          stale = stale || changes_->count(deps_log_->Path(id)) > 0;
+        }
+      }
+    }
+    if (stale && !running.cancelled) {
+      running.cancelled = true;
+      kill(kv.first, SIGTERM);
+    }
+  }
+}
+
+void Executor::complete(const os::Spawner::Finished& finished) {
+  auto it = running_.find(finished.pid);
+  const size_t target = it->second.target;
+  const string& name = graph_.names[target];
+  const bool cancelled = it->second.cancelled;
+  const int status = finished.status;
+  busy_slots_[it->second.slot - 1] = false;
+  Job& job = jobs_by_target_.at(target);
+  const Action& action = job.actions[it->second.action];
+  const uint64_t fingerprint = job.fingerprints[it->second.action];
+  const int64_t end_us = os::NowMicros();
+  usages_.push_back(
+      {name, action.kind, end_us - it->second.begin_us, finished.usage});
+  if (!finished.output.empty()) {
+    // In one piece, so that parallel actions do not interleave.
+    std::cerr << "  " + action.message + ":\n" + finished.output << std::flush;
+  }
+  if (Tracer* tracer = Tracer::Get(); tracer->enabled()) {
+    tracer->Slice(action.kind, "action", it->second.slot, it->second.begin_us,
+                  end_us,
+                  {{"target", name},
+                   {"argv", action.program + " " +
+                            strings::Join(action.args, " ")},
+                   {"status", std::to_string(status)}});
+  }
+  running_.erase(it);
+  --job.running;
+  error err;
+  if (cancelled) {
+    for (const string& output : action.outputs) {
+      unlink(output.c_str());
+    }
+    err = "cancelled, its inputs changed";
+  } else {
+    err = os::StatusError(action.program, status);
+  }
+  if (err == "" && !action.depfile.empty()) {
+    string depfile = strings::ReadFileToString(action.depfile);
+    vector<std::string_view> deps;
+    if (error parse_err = parseDepfile(&depfile, &deps); parse_err != "") {
+      err = action.depfile + ": " + parse_err;
+    } else {
+      deps_log_->Record(action.outputs[0], deps);
+      unlink(action.depfile.c_str());
+      if (files_->Watching()) {
+        for (std::string_view dep : deps) {
+          files_->ModTime(string(dep));  // Start watching it.
+        }
+      }
+    }
+  }
+  if (err == "") {
+    for (const string& output : action.outputs) {
+      files_->Written(output);
+      log_->Record(output, fingerprint);
+    }
+    if (store_ != nullptr) {
+      store_->Insert(action, fingerprint, *deps_log_);
+    }
+  }
+  if (job.failed) {
+    // Failed on an earlier action of the same stage.
+    if (job.running == 0) {
+      jobs_by_target_.erase(target);
+    }
+    return;
+  }
+  if (err != "") {
+    fail(target, "[" + action.kind + "] " + err);
+    return;
+  }
+  if (job.running > 0) {
+    // The rest of the stage may start in the slot this one freed.
+    if (job.next < job.actions.size() &&
+        job.actions[job.next].stage == action.stage) {
+      makeReady(target);
+    }
+    return;
+  }
+  if (job.next < job.actions.size()) {
+    makeReady(target);
+  } else {
+    finish(target);
+  }
+}
+
+error Executor::Run() {
+  for (size_t target = 0; target < graph_.names.size(); ++target) {
+    if (graph_.pending_deps[target] == 0) {
+      makeReady(target);
+    }
+  }
+  while (!ready_.empty() || !running_.empty()) {
+    while (running_.size() < jobs_ && !ready_.empty()) {
+      const size_t target = ready_.top().second;
+      ready_.pop();
+      start(target);
+    }
+    if (!running_.empty()) {
+      wait();
+    }
+  }
+  if (num_run_ == 0 && err_ == "" && num_fetched_ == 0) {
+    std::cout << "  everything is up to date\n";
+  }
+  return err_;
+}
+
+// How many targets the end-of-build usage table lists.
+const size_t kUsageTopN = 10;
+
+// A table of the targets that took the most CPU time, adding up their
+// actions, or "" if nothing ran.
+string summarizeUsage(const vector<Executor::ActionUsage>& usages) {
+  if (usages.empty()) {
+    return "";
+  }
+  map<string, Executor::ActionUsage> by_target;
+  for (const Executor::ActionUsage& u : usages) {
+    Executor::ActionUsage& sum = by_target[u.target];
+    sum.target = u.target;
+    sum.wall_us += u.wall_us;
+    sum.usage.user_us += u.usage.user_us;
+    sum.usage.sys_us += u.usage.sys_us;
+    sum.usage.max_rss_kb = std::max(sum.usage.max_rss_kb, u.usage.max_rss_kb);
+    sum.usage.major_faults += u.usage.major_faults;
+    sum.usage.minor_faults += u.usage.minor_faults;
+  }
+  vector<Executor::ActionUsage> sorted;
+  int64_t peak_rss_kb = 0;
+  for (const auto& kv : by_target) {
+    sorted.push_back(kv.second);
+    peak_rss_kb = std::max(peak_rss_kb, kv.second.usage.max_rss_kb);
+  }
+  auto cpu = [](const Executor::ActionUsage& u) {
+    return u.usage.user_us + u.usage.sys_us;
+  };
+  std::sort(sorted.begin(), sorted.end(), [&](const auto& a, const auto& b) {
+    return cpu(a) > cpu(b);
+  });
+  if (sorted.size() > kUsageTopN) {
+    sorted.resize(kUsageTopN);
+  }
+  char line[256];
+  snprintf(line, sizeof(line), "  %-24s %8s %8s %8s %8s %8s %8s\n", "target",
+           "wall s", "user s", "sys s", "rss MiB", "majflt", "minflt");
+  string s = line;
+  for (const Executor::ActionUsage& u : sorted) {
+    snprintf(line, sizeof(line),
+             "  %-24s %8.2f %8.2f %8.2f %8lld %8lld %8lld\n",
+             u.target.c_str(), static_cast<double>(u.wall_us) / 1e6,
+             static_cast<double>(u.usage.user_us) / 1e6,
+             static_cast<double>(u.usage.sys_us) / 1e6,
+             static_cast<long long>(u.usage.max_rss_kb / 1024),
+             static_cast<long long>(u.usage.major_faults),
+             static_cast<long long>(u.usage.minor_faults));
+    s += line;
+  }
+  snprintf(line, sizeof(line), "  peak rss %lld MiB\n",
+           static_cast<long long>(peak_rss_kb / 1024));
+  return s + line;
+}
+
+// Writes one map per action to `path', as an eden vector that AA tooling can
+// read back.
+error writeUsage(const string& path,
+                 const vector<Executor::ActionUsage>& usages) {
+  string s = "[\n";
+  eden::Writer writer(&s, eden::Writer::Style::Compact);
+  auto keyword = [](std::string_view name) {
+    return eden::Node::Keyword(eden::Intern(name));
+  };
+  for (const Executor::ActionUsage& u : usages) {
+    eden::Node fields[] = {
+        keyword("target"), eden::Node::String(u.target),
+        keyword("kind"), eden::Node::String(u.kind),
+        keyword("wall-us"), eden::Node::Int(u.wall_us),
+        keyword("user-us"), eden::Node::Int(u.usage.user_us),
+        keyword("sys-us"), eden::Node::Int(u.usage.sys_us),
+        keyword("max-rss-kb"), eden::Node::Int(u.usage.max_rss_kb),
+        keyword("major-faults"), eden::Node::Int(u.usage.major_faults),
+        keyword("minor-faults"), eden::Node::Int(u.usage.minor_faults),
+    };
+    eden::Node* items[std::size(fields)];
+    for (size_t i = 0; i < std::size(fields); ++i) {
+      items[i] = &fields[i];
+    }
+    s += " ";
+    writer.Write(eden::Node::Collection(eden::Node::Type::Map, items,
+                                        std::size(items)));
+    s += "\n";
+  }
+  s += "]\n";
+  std::ofstream out(path);
+  out << s;
+  out.close();
+  return out ? "" : "could not write " + path;
+}
+
+error Manager::Resolve(const vector<string>& targets, BuildState* state,
+                       set<string>* changes) {
+  {
+    TraceSpan span("load rules");
+    if (error err = Load(targets); err != "") {
+      return err;
+    }
+  }
+  set<string> target_set(targets.begin(), targets.end());
+  map<string, set<string>> dependencies;
+  for (const auto& kv : rules_) {
+    const string& target = kv.first;
+    const vector<string>& deps = kv.second->Deps();
+    dependencies[target].insert(deps.begin(), deps.end());
+  }
+  auto err_and_graph = [&]() {
+    TraceSpan span("build target graph");
+    return buildTargetGraph(target_set, dependencies);
+  }();
+  if (err_and_graph.first != "") {
+    return err_and_graph.first;
+  }
+  state->Open(string(module_attrs_->At(":out-dir").AsString()));
+  string cacheDir = os::HomeDir() + "/.cache/aa/";
+  if (const eden::Node* value = module_attrs_->Find(":cache-dir")) {
+    cacheDir = value->AsString();
+    if (cacheDir.compare(0, 2, "~/") == 0) {
+      cacheDir = os::HomeDir() + cacheDir.substr(1);
+    }
+    if (cacheDir.back() != '/') {
+      cacheDir += '/';
+    }
+  }
+  uint64_t cacheMaxBytes = 0;
+  if (const eden::Node* value = module_attrs_->Find(":cache-max-bytes")) {
+    cacheMaxBytes = value->IsInt()
+        ? static_cast<uint64_t>(std::max<int64_t>(0, value->AsInt()))
+        : 0;
+  }
+  ObjectStore store(cacheDir, cacheMaxBytes);
+  store.StartEviction();
+  Executor executor(jobs_, std::move(err_and_graph.second), rules_, state,
+                    &store);
+  if (changes != nullptr) {
+    executor.CancelOnChange(changes);
+  }
+  error err = executor.Run();
+  std::cout << store.FinishAndSummarize();
+  if (!executor.Usages().empty()) {
+    std::cout << summarizeUsage(executor.Usages());
+    const string usagePath =
+        string(module_attrs_->At(":out-dir").AsString()) + ".aa_usage";
+    if (error err = writeUsage(usagePath, executor.Usages()); err != "") {
+      std::cerr << "aa: " << err << "\n";
+    }
+  }
+  return err;
+}
+
+const string Manager::ListTargets() {
+  set<string> targets;
+  for (const auto& kv : rules_) {
+    if (kv.first.compare(0, 4, "pch:") != 0) {  // Added by processRule().
+      targets.insert(kv.first);
+    }
+  }
+  for (const auto& kv : unread_rules_) {
+    targets.emplace(kv.first);
+  }
+  string s;
+  for (const string& target : targets) {
+    s += "  " + target + "\n";
+  }
+  return s;
+}
+
+// Given a source file, say "hello/greet.cc" return the preferred target name,
+// i.e., "greet.hello" for that case.
+const string targetNameFromSource(const string& source) {
+  const string sourceSansExt = path::SansExt(source);
+  vector<string> chunks = strings::Split(sourceSansExt, '/');
+  std::reverse(chunks.begin(), chunks.end());
+  return strings::Join(chunks, ".");
+}
+
+// Command line:
+//   aa [-j N] [--watch] [--trace=FILE] [--no-server] [TARGET...]
+//   aa --server | --shutdown
+struct Options {
+  size_t jobs = os::NumCpus();
+  bool serve = false;      // Start a server for this workspace.
+  bool shutdown = false;   // Stop the server of this workspace.
+  bool no_server = false;  // Build in this process even if there is a server.
+  bool watch = false;      // Rebuild whenever the inputs change.
+  string trace;            // Write a Chrome trace of the build here.
+  vector<string> targets;
+};
+
+error ParseOptions(const vector<string>& args, Options* options) {
+  for (size_t i = 0; i < args.size(); ++i) {
+    const string& arg = args[i];
+    if (arg == "--server") {
+      options->serve = true;
+      continue;
+    }
+    if (arg == "--shutdown") {
+      options->shutdown = true;
+      continue;
+    }
+    if (arg == "--no-server") {
+      options->no_server = true;
+      continue;
+    }
+    if (arg == "--watch") {
+      options->watch = true;
+      continue;
+    }
+    if (arg.compare(0, 8, "--trace=") == 0) {
+      options->trace = arg.substr(8);
+      continue;
+    }
+    if (arg.compare(0, 2, "-j") != 0) {
+      options->targets.push_back(arg);
+      continue;
+    }
+    string value = arg.substr(2);
+    if (value.empty()) {
+      if (++i == args.size()) {
+        return "-j requires a number";
+      }
+      value = args[i];
+    }
+    char* end = nullptr;
+    unsigned long jobs = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || jobs == 0) {
+      return "invalid value for -j: " + value;
+    }
+    options->jobs = jobs;
+  }
+  return "";
+}
+
+// Parsed files (the defaults; AA files are indexed instead, see
+// Manager::Index), in eden's binary encoding, so that the next run decodes an
+// unchanged file instead of parsing it.  An entry is named
+// after the file's absolute path and records the size, mtime and hash of the
+// contents it was made from.  Size and mtime are enough to trust it; a file
+// that was only touched (or checked out again) is recognized by its hash.
+class ParseCache {
+ public:
+  explicit ParseCache(const string& dir) : dir_(dir) {}
+
+  // The tree of the file at `path', or nullptr if it does not parse.
+  eden::Tree Read(const string& path);
+
+ private:
+  static constexpr char kMagic[8] = {'A', 'A', 'P', 'A', 'R', 'S', 'E', 1};
+  struct Header {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+  };
+
+  // Decodes `entry' if it is current for a file with `size' and `mtime',
+  // reading the file into `*contents' if it has to compare hashes.
+  eden::Tree lookup(const string& entry, const string& path, uint64_t size,
+                    int64_t mtime, string* contents);
+  void store(const string& entry, const Header& header,
+             const eden::Node& root);
+
+  const string dir_;
+};
+
+eden::Tree ParseCache::Read(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return eden::read(strings::ReadFileToString(path));
+  }
+  const uint64_t size = static_cast<uint64_t>(st.st_size);
+  const int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                        st.st_mtim.tv_nsec;
+  const string entry =
+      dir_ + strings::Hex(strings::Hash(path::Absolute(path)));
+  string contents;
+  if (eden::Tree root = lookup(entry, path, size, mtime, &contents)) {
+    return root;
+  }
+  if (contents.empty()) {
+    contents = strings::ReadFileToString(path);
+  }
+  eden::Tree root = eden::read(contents);
+  if (root != nullptr) {
+    Header header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.size = size;
+    header.mtime = mtime;
+    header.hash = strings::Hash(contents);
+    store(entry, header, *root);
+  }
+  return root;
+}
+
+eden::Tree ParseCache::lookup(const string& entry, const string& path,
+                              uint64_t size, int64_t mtime, string* contents) {
+  const int fd = open(entry.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat st;
+  Header header;
+  void* data = MAP_FAILED;
+  const size_t length =
+      fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+  if (length > sizeof(Header)) {
+    data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  eden::Tree root;
+  if (data != MAP_FAILED) {
+    memcpy(&header, data, sizeof(header));
+    bool current = memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                   header.size == size;
+    if (current && header.mtime != mtime) {
+      *contents = strings::ReadFileToString(path);
+      current = strings::Hash(*contents) == header.hash;
+      if (current) {
+        header.mtime = mtime;
+        current = pwrite(fd, &header, sizeof(header), 0) ==
+                  static_cast<ssize_t>(sizeof(header));
+      }
+    }
+    if (current) {
+      root = eden::decode(static_cast<const char*>(data) + sizeof(Header),
+                          length - sizeof(Header));
+    }
+    munmap(data, length);
+  }
+  close(fd);
+  return root;
+}
+
+void ParseCache::store(const string& entry, const Header& header,
+                       const eden::Node& root) {
+  const string encoded = eden::encode(root);
+  if (encoded.empty() || path::MakeContainingDir(entry) != "") {
+    return;
+  }
+  string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data += encoded;
+  const string tmp = entry + ".tmp" + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+  const bool ok = write(fd, data.data(), data.size()) ==
+                  static_cast<ssize_t>(data.size());
+  if (close(fd) != 0 || !ok || rename(tmp.c_str(), entry.c_str()) != 0) {
+    unlink(tmp.c_str());
+  }
+}
+
+// Everything a build needs that is worth keeping from one build to the next:
+// the parsed defaults, the AA file, the Manager made from them, and the
+// BuildState.  A one-off `aa' fills it in once; the server keeps it and only
+// re-parses the files that changed.
+class Workspace {
+ public:
+  Workspace() {}
+  ~Workspace() {}
+
+  // (Re-)reads the defaults and the AA file if they changed since last time.
+  error Load();
+  // The :out-dir of the AA file's module attributes, or else the defaults',
+  // as Load() would find it, but reading the AA file only up to its first
+  // form.
+  error OutDir(string* out_dir);
+  Manager* manager() { return manager_.get(); }
+  BuildState* state() { return &state_; }
+
+ private:
+  struct ParsedFile {
+    int64_t mtime;
+    eden::Tree root;
+    string text;  // Instead of `root', for the AA file, which is Index()ed.
+  };
+
+  // Parses `path', or if `text_only' just reads it, unless the version in
+  // `parsed_' is still current.
+  error parse(const string& path, bool text_only, bool* changed);
+
+  ParseCache parse_cache_{os::HomeDir() + "/.cache/aa/parsed/"};
+  map<string, ParsedFile> parsed_;
+  std::unique_ptr<Manager> manager_;
+  BuildState state_;
+};
+
+error Workspace::parse(const string& path, bool text_only, bool* changed) {
+  const int64_t mtime = state_.files.ModTime(path);
+  auto it = parsed_.find(path);
+  if (it != parsed_.end() && it->second.mtime == mtime) {
+    *changed = false;
+    return "";
+  }
+  *changed = true;
+  if (text_only) {
+    parsed_[path] = ParsedFile{mtime, nullptr, strings::ReadFileToString(path)};
+    return "";
+  }
+  TraceSpan span("parse", {{"file", path}});
+  eden::Tree root = parse_cache_.Read(path);
+  if (root == nullptr) {
+    return "could not parse " + path;
+  }
+  parsed_[path] = ParsedFile{mtime, std::move(root), ""};
+  return "";
+}
+
+error Workspace::Load() {
+  const string defaultsFile = os::HomeDir() + "/.config/aa/defaults";
+  bool defaults_changed;
+  if (error err = parse(defaultsFile, false, &defaults_changed); err != "") {
+    return err;
+  }
+  const bool fresh = manager_ == nullptr || defaults_changed;
+  if (fresh) {
+    manager_.reset(new Manager(*parsed_[defaultsFile].root));
+  }
+  const string aaFile = manager_->AaFile();
+  bool aa_changed;
+  if (error err = parse(aaFile, true, &aa_changed); err != "") {
+    manager_.reset();
+    return err;
+  }
+  if (!fresh && !aa_changed) {
+    return "";
+  }
+  if (!fresh) {
+    manager_.reset(new Manager(*parsed_[defaultsFile].root));
+  }
+  TraceSpan span("index rules", {{"file", aaFile}});
+  if (error err = manager_->Index(parsed_[aaFile].text); err != "") {
+    manager_.reset();
+    return err;
+  }
+  return "";
+}
+
+error Workspace::OutDir(string* out_dir) {
+  const string defaultsFile = os::HomeDir() + "/.config/aa/defaults";
+  bool changed;
+  if (error err = parse(defaultsFile, false, &changed); err != "") {
+    return err;
+  }
+  Manager defaults(*parsed_[defaultsFile].root);
+  const string aaFile = defaults.AaFile();
+  const int fd = open(aaFile.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return "could not open " + aaFile;
+  }
+  eden::Tree first;
+  eden::Reader reader([&first](eden::Tree form) {
+    if (first == nullptr) {
+      first = std::move(form);
+    }
+  });
+  char buffer[4096];
+  ssize_t n = 0;
+  while (first == nullptr && (n = read(fd, buffer, sizeof(buffer))) > 0 &&
+         reader.Feed(std::string_view(buffer, static_cast<size_t>(n)))) {
+  }
+  if (first == nullptr && n == 0) {
+    reader.Finish();
+  }
+  close(fd);
+  const eden::Node* value = nullptr;
+  if (first != nullptr && first->IsMap()) {
+    value = first->Get(eden::Node::Keyword(eden::Intern("out-dir")));
+  }
+  *out_dir = value != nullptr && value->IsString() ? string(value->AsString())
+                                                   : defaults.OutDir();
+  return "";
+}
+
+// Runs one aa command (anything but starting or stopping the server) and
+// returns the exit status.  `changes' is as for Manager::Resolve.
+int runCommand(const Options& options, Workspace* workspace,
+               set<string>* changes = nullptr) {
+  if (!options.trace.empty()) {
+    Tracer::Get()->Start();
+  }
+  int status = 0;
+  error err = workspace->Load();
+  if (err != "") {
+    std::cerr << err << "\n";
+  }
+  Manager* m = workspace->manager();
+  if (m == nullptr) {
+    status = 1;
+  } else if (options.targets.empty()) {
+    std::cout << m->ListTargets();
+  } else {
+    m->SetJobs(options.jobs);
+    err = m->Resolve(options.targets, workspace->state(), changes);
+    if (err != "") {
+      std::cerr << err << "\n";
+      status = 1;
+    }
+  }
+  if (!options.trace.empty()) {
+    if (err = Tracer::Get()->Finish(options.trace); err != "") {
+      std::cerr << "aa: " << err << "\n";
+    }
+  }
+  return status;
+}
+
+// How long --watch waits for more changes after the first one, so that a
+// burst of saves (or a `git checkout') makes a single rebuild.
+const int kDebounceMs = 100;
+
+// aa --watch: builds, waits for any of the files the build looked at (the
+// sources, headers and AA files reachable from the requested targets) to
+// change, and builds again.  Runs until interrupted.
+int watchCommand(const Options& options, Workspace* workspace) {
+  FileStates* files = &workspace->state()->files;
+  const int fd = files->Watch();
+  if (fd == -1) {
+    std::cerr << "aa: could not initialize inotify\n";
+    return 1;
+  }
+  set<string> changes;
+  for (;;) {
+    runCommand(options, workspace, &changes);
+    std::cout << "aa: watching for changes\n" << std::flush;
+    while (changes.empty()) {
+      struct pollfd p = {fd, POLLIN, 0};
+      poll(&p, 1, -1);
+      for (const string& path : files->ProcessEvents()) {
+        changes.insert(path);
+      }
+    }
+    for (;;) {
+      struct pollfd p = {fd, POLLIN, 0};
+      if (poll(&p, 1, kDebounceMs) <= 0) {
+        break;
+      }
+      for (const string& path : files->ProcessEvents()) {
+        changes.insert(path);
+      }
+    }
+    std::cout << "aa: " << changes.size() << " files changed\n";
+    changes.clear();
+  }
+}
+
+// The server ("aa --server") keeps a Workspace warm for the builds of one
+// directory.  Clients connect to serverSocket() and send, in one message, the
+// command line arguments (each terminated by '\0', the whole preceded by its
+// 32-bit length) along with their stdout and stderr as SCM_RIGHTS.  The server
+// runs the command with those as its own stdout and stderr, so the output
+// (compilers' included) goes straight to the client's terminal, and answers
+// with the exit status in one byte.  Requests are served one at a time.
+string serverSocket(const string& out_dir) { return out_dir + ".aa.sock"; }
+
+error sendRequest(int fd, const vector<string>& args) {
+  string payload;
+  for (const string& arg : args) {
+    payload += arg;
+    payload += '\0';
+  }
+  const uint32_t size = static_cast<uint32_t>(payload.size());
+  payload.insert(0, reinterpret_cast<const char*>(&size), sizeof(size));
+  const int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {&payload[0], payload.size()};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(payload.size())) {
+    return "could not send the request";
+  }
+  return "";
+}
+
+// Reads a request sent by sendRequest.  On success, `*fds' are the client's
+// stdout and stderr, owned by the caller.
+error recvRequest(int fd, vector<string>* args, int fds[2]) {
+  fds[0] = fds[1] = -1;
+  uint32_t size = 0;
+  alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+  struct iovec iov = {&size, sizeof(size)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(size)) {
+    return "short request";
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+    return "request without file descriptors";
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+  string payload(size, '\0');
+  if (size > 0 && recv(fd, &payload[0], size, MSG_WAITALL) !=
+                      static_cast<ssize_t>(size)) {
+    return "short request";
+  }
+  vector<string> parsed = strings::Split(payload, '\0');
+  parsed.pop_back();  // After the last '\0'.
+  *args = std::move(parsed);
+  return "";
+}
+
+int connectToServer(const string& socket_path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  if (fd != -1 && connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                          sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Runs the command on the server listening at `socket_path'.  Returns false if
+// there is no server to talk to.
+bool runOnServer(const string& socket_path, const vector<string>& args,
+                 int* status) {
+  int fd = connectToServer(socket_path);
+  if (fd == -1) {
+    return false;
+  }
+  uint8_t result = 1;
+  ssize_t n = -1;
+  if (error err = sendRequest(fd, args); err != "") {
+    std::cerr << "aa: " << err << "\n";
+  } else {
+    while ((n = read(fd, &result, 1)) == -1 && errno == EINTR) {
+    }
+  }
+  if (n != 1) {
+    std::cerr << "aa: lost the connection to the server\n";
+    result = 1;
+  }
+  close(fd);
+  *status = result;
+  return true;
+}
+
+class Server {
+ public:
+  Server() {}
+  ~Server() {
+    if (listen_fd_ != -1) {
+      close(listen_fd_);
+      unlink(socket_path_.c_str());
+    }
+  }
+
+  // Loads the workspace and listens at the serverSocket() of its :out-dir.
+  error Listen();
+  const string& socket_path() const { return socket_path_; }
+  // Serves requests until one asks for a shutdown.
+  void Serve();
+
+ private:
+  // Returns false if the server should stop.
+  bool handle(int client_fd);
+
+  string socket_path_;
+  int listen_fd_ = -1;
+  int inotify_fd_ = -1;
+  Workspace workspace_;
+};
+
+error Server::Listen() {
+  inotify_fd_ = workspace_.state()->files.Watch();
+  if (inotify_fd_ == -1) {
+    return "could not initialize inotify";
+  }
+  // Parse everything now, so that the first build is fast, too.
+  if (error err = workspace_.Load(); err != "") {
+    return err;
+  }
+  socket_path_ = serverSocket(workspace_.manager()->OutDir());
+  int fd = connectToServer(socket_path_);
+  if (fd != -1) {
+    close(fd);
+    return "a server is already running at " + socket_path_;
+  }
+  unlink(socket_path_.c_str());  // Stale.
+  path::MakeContainingDir(socket_path_);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    return "the path of the socket is too long: " + socket_path_;
+  }
+  strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+  if (listen_fd_ == -1 ||
+      bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_fd_, 16) != 0) {
+    return "could not listen on " + socket_path_;
+  }
+  return "";
+}
+
+void Server::Serve() {
+  signal(SIGPIPE, SIG_IGN);
+  for (;;) {
+    struct pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+    if (poll(fds, 2, -1) == -1) {
+      continue;  // EINTR
+    }
+    if (fds[1].revents & POLLIN) {
+      workspace_.state()->files.ProcessEvents();
+    }
+    if (fds[0].revents & POLLIN) {
+      int client_fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client_fd == -1) {
+        continue;
+      }
+      const bool keep_going = handle(client_fd);
+      close(client_fd);
+      if (!keep_going) {
+        return;
+      }
+    }
+  }
+}
+
+bool Server::handle(int client_fd) {
+  vector<string> args;
+  int client_fds[2];
+  if (error err = recvRequest(client_fd, &args, client_fds); err != "") {
+    std::cerr << "aa: " << err << "\n";
+    return true;
+  }
+  // Whatever changed on disk up to now is already queued.
+  workspace_.state()->files.ProcessEvents();
+
+  std::cout.flush();
+  const int saved_stdout = dup(STDOUT_FILENO);
+  const int saved_stderr = dup(STDERR_FILENO);
+  dup2(client_fds[0], STDOUT_FILENO);
+  dup2(client_fds[1], STDERR_FILENO);
+  close(client_fds[0]);
+  close(client_fds[1]);
+
+  Options options;
+  int status = 0;
+  if (error err = ParseOptions(args, &options); err != "") {
+    std::cerr << err << "\n";
+    status = 2;
+  } else if (!options.shutdown) {
+    status = runCommand(options, &workspace_);
+  }
+
+  std::cout.flush();
+  dup2(saved_stdout, STDOUT_FILENO);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stdout);
+  close(saved_stderr);
+  const uint8_t result = static_cast<uint8_t>(status);
+  send(client_fd, &result, 1, MSG_NOSIGNAL);
+  return !options.shutdown;
+}
+
+#ifndef AA_NO_MAIN  // aa-test.cc and aa-bench.cc bring their own.
+int main(int argc, char* argv[], char** envp) {
+  os::Runtime runtime(argc, argv, envp);
+  Options options;
+  error err = ParseOptions(runtime.args(), &options);
   if (err != "") {
     std::cerr << err << "\n";
+    return 2;
+  }
+
+  if (options.serve) {
+    Server server;
+    if (err = server.Listen(); err != "") {
+      std::cerr << "aa: " << err << "\n";
+      return 1;
+    }
+    std::cout << "aa: serving " << server.socket_path() << "\n"
+              << std::flush;
+    // Detach from the terminal and keep going in the background.
+    pid_t pid = fork();
+    if (pid != 0) {
+      _exit(pid == -1 ? 1 : 0);
+    }
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    server.Serve();
+    return 0;
+  }
+
+  Workspace workspace;
+  if (options.watch) {
+    return watchCommand(options, &workspace);
+  }
+  if (string out_dir; !options.no_server && workspace.OutDir(&out_dir) == "") {
+    int status;
+    if (runOnServer(serverSocket(out_dir), runtime.args(), &status)) {
+      return status;
+    }
+  }
+  if (options.shutdown) {
+    std::cerr << "aa: no server is running\n";
     return 1;
   }
-  return 0;
+  return runCommand(options, &workspace);
 }
+#endif  // AA_NO_MAIN
@@ -1,9 +1,26 @@
 #ifndef _BASIC_H_
 #define _BASIC_H_
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -18,10 +35,14 @@
 #include <set>
 #include <streambuf>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 using std::list;
+using std::make_pair;
 using std::map;
 using std::pair;
 using std::set;
@@ -51,10 +72,31 @@ const string SansExt(const string& path) {
   return i == string::npos ? path : path.substr(0, i);
 }
 
+// MakeContainingDir("foo/bar/baz.o") creates foo/ and foo/bar/, like
+// `mkdir -p foo/bar'.
 error MakeContainingDir(const string& path) {
+  for (size_t i = path.find('/', 1); i != string::npos;
+       i = path.find('/', i + 1)) {
+    const string dir = path.substr(0, i);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return "could not create directory " + dir;
+    }
+  }
   return "";
 }
 
+// Absolute("basic.h") -> "/home/me/src/aa/basic.h", or the path itself if it
+// does not exist.
+const string Absolute(const string& path) {
+  char* resolved = realpath(path.c_str(), nullptr);
+  if (resolved == nullptr) {
+    return path;
+  }
+  string absolute = resolved;
+  free(resolved);
+  return absolute;
+}
+
 } // ::path
 
 namespace strings {
@@ -79,32 +121,161 @@ string Join(const vector<string>& v, const string& sep) {
   return r.substr(0, r.size() - sep.size());
 }
 
+// The contents of `filepath', or "" if it cannot be read.
 string ReadFileToString(const string& filepath) {
-  std::ifstream stream(filepath);
-  std::string contents((std::istreambuf_iterator<char>(stream)),
-                       std::istreambuf_iterator<char>());
+  string contents;
+  int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return contents;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    contents.reserve(static_cast<size_t>(st.st_size));
+  }
+  char buffer[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (n > 0) {
+      contents.append(buffer, static_cast<size_t>(n));
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+  close(fd);
   return contents;
 }
 
+// Writes `contents' to `filepath', creating its directory, unless the file
+// already has them (so its mtime only moves when it changes).
+error WriteFileIfChanged(const string& filepath, const string& contents) {
+  if (ReadFileToString(filepath) == contents) {
+    return "";
+  }
+  if (error err = path::MakeContainingDir(filepath); err != "") {
+    return err;
+  }
+  std::ofstream stream(filepath);
+  stream << contents;
+  stream.close();
+  return stream ? "" : "could not write " + filepath;
+}
+
+// 64-bit FNV-1a.  Not cryptographic; good enough to fingerprint command lines
+// and file names.
+const uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+uint64_t Hash(const char* data, size_t size, uint64_t h = kHashSeed) {
+  for (size_t i = 0; i < size; ++i) {
+    h ^= static_cast<uint8_t>(data[i]);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+uint64_t Hash(const string& s, uint64_t h = kHashSeed) {
+  return Hash(s.data(), s.size(), h);
+}
+
+// Hashes the contents of the file at `path' into `*h'.  Returns false if the
+// file cannot be read.
+bool HashFile(const string& path, uint64_t* h) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  char buffer[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    *h = Hash(buffer, static_cast<size_t>(n), *h);
+  }
+  close(fd);
+  return n == 0;
+}
+
+// "%016x"
+string Hex(uint64_t x) {
+  static const char kDigits[] = "0123456789abcdef";
+  string s(16, '0');
+  for (size_t i = 16; i-- > 0; x >>= 4) {
+    s[i] = kDigits[x & 0xf];
+  }
+  return s;
+}
+
+// Quotes `s' as a JSON string.
+string JsonQuote(const string& s) {
+  static const char kHex[] = "0123456789abcdef";
+  string q = "\"";
+  for (const char c : s) {
+    if (c == '"' || c == '\\') {
+      q += '\\';
+      q += c;
+    } else if (static_cast<uint8_t>(c) < 0x20) {
+      q += "\\u00";
+      q += kHex[(c >> 4) & 0xf];
+      q += kHex[c & 0xf];
+    } else {
+      q += c;
+    }
+  }
+  return q + "\"";
+}
+
 } // ::strings
 
 namespace os {
-// Arguments are passed by value because we need the clones.
-error ForkExecWait(const string program, const vector<string> args) {
-  int childpid = fork();
-  if (childpid == 0) { // at the child
-    size_t n = args.size();
-    vector<char*> argv(n + 2);
-    argv[0] = const_cast<char*>(program.c_str());
-    for (size_t i = 0; i <= n; i++) {
-      argv[i + 1] = const_cast<char*>(args[i].c_str());
-    }
-    argv[n+1] = nullptr;
-    execv(argv[0], &argv[0]);
-    return ""; // Dummy; execv() should never return.
+// Starts `program' with posix_spawn(), which does not copy our address space
+// the way fork() does.  If `out_fd' is given, the child's stdout and stderr go
+// there.  Returns -1 if the program could not be started.
+pid_t Spawn(const string& program, const vector<string>& args,
+            int out_fd = -1) {
+  const size_t n = args.size();
+  vector<char*> argv(n + 2);
+  argv[0] = const_cast<char*>(program.c_str());
+  for (size_t i = 0; i < n; i++) {
+    argv[i + 1] = const_cast<char*>(args[i].c_str());
   }
-  int status = 0;
-  waitpid(childpid, &status, 0);
+  argv[n + 1] = nullptr;
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  if (out_fd != -1) {
+    posix_spawn_file_actions_adddup2(&file_actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&file_actions, out_fd, STDERR_FILENO);
+  }
+  pid_t childpid;
+  const int err = posix_spawn(&childpid, argv[0], &file_actions, nullptr,
+                              argv.data(), environ);
+  posix_spawn_file_actions_destroy(&file_actions);
+  return err == 0 ? childpid : -1;
+}
+
+// Resources used by a child process, as reported by wait4().
+struct Usage {
+  int64_t user_us = 0;
+  int64_t sys_us = 0;
+  int64_t max_rss_kb = 0;
+  int64_t major_faults = 0;
+  int64_t minor_faults = 0;
+};
+
+// Reaps the child `pid' (or any child, if -1) and returns its pid, or -1.
+pid_t Wait(pid_t pid, int* status, Usage* usage = nullptr) {
+  struct rusage ru;
+  pid_t reaped;
+  do {
+    reaped = wait4(pid, status, 0, &ru);
+  } while (reaped == -1 && errno == EINTR);
+  if (reaped != -1 && usage != nullptr) {
+    usage->user_us = ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    usage->sys_us = ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+    usage->max_rss_kb = ru.ru_maxrss;
+    usage->major_faults = ru.ru_majflt;
+    usage->minor_faults = ru.ru_minflt;
+  }
+  return reaped;
+}
+
+error StatusError(const string& program, int status) {
   if (status == 0) {
     return "";
   }
@@ -112,6 +283,228 @@ error ForkExecWait(const string program, const vector<string> args) {
       std::to_string(status);
 }
 
+// Arguments are passed by value because we need the clones.
+error ForkExecWait(const string program, const vector<string> args,
+                   Usage* usage = nullptr) {
+  pid_t childpid = Spawn(program, args);
+  if (childpid == -1) {
+    return "could not start " + program;
+  }
+  int status = 0;
+  if (Wait(childpid, &status, usage) == -1) {
+    return "could not wait for " + program;
+  }
+  return StatusError(program, status);
+}
+
+// A pidfd for the child `pid', which polls readable once it terminates, or -1
+// if the kernel is too old (Linux < 5.3).
+int PidFd(pid_t pid) {
+  // Through syscall(), as older C libraries have no wrapper.
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// Runs child processes with their stdout and stderr captured, and reports the
+// ones that finished without blocking on any one of them.  All the pipes and
+// pidfds go into one epoll set.
+class Spawner {
+ public:
+  struct Finished {
+    pid_t pid;
+    int status;
+    Usage usage;
+    string output;  // Its stdout and stderr, interleaved.
+  };
+
+  Spawner() : epoll_(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~Spawner() {
+    for (const auto& kv : children_) {
+      close(kv.second.out);
+      if (kv.second.pidfd != -1) {
+        close(kv.second.pidfd);
+      }
+    }
+    close(epoll_);
+  }
+
+  // Starts `program' (see Spawn()).  Returns -1 if it could not be started.
+  pid_t Start(const string& program, const vector<string>& args) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      return -1;
+    }
+    const pid_t pid = Spawn(program, args, fds[1]);
+    close(fds[1]);
+    if (pid == -1) {
+      close(fds[0]);
+      return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    Child& child = children_[pid];
+    child.out = fds[0];
+    child.pidfd = PidFd(pid);
+    add(child.out, key(pid, false));
+    if (child.pidfd != -1) {
+      add(child.pidfd, key(pid, true));
+    }
+    return pid;
+  }
+
+  // Makes Wait() return when `fd' is readable, too.
+  void Watch(int fd) { add(fd, kWatched); }
+
+  // Blocks until a child finishes or a Watch()ed fd is readable, for at most
+  // `timeout_ms' (-1: no limit).  Appends the children that finished to
+  // `*finished' and returns whether a watched fd is readable.
+  bool Wait(int timeout_ms, vector<Finished>* finished) {
+    struct epoll_event events[16];
+    const int n = epoll_wait(epoll_, events, 16, timeout_ms);
+    bool watched = false;
+    for (int i = 0; i < n; ++i) {
+      const uint64_t k = events[i].data.u64;
+      if (k == kWatched) {
+        watched = true;
+        continue;
+      }
+      auto it = children_.find(static_cast<pid_t>(k >> 1));
+      if (it == children_.end()) {
+        continue;  // Reaped earlier in this loop.
+      }
+      Child& child = it->second;
+      if (k & 1) {
+        reap(it, finished);  // Its pidfd says it exited.
+      } else if (drain(&child)) {
+        if (child.pidfd == -1) {
+          reap(it, finished);  // No pidfd; the pipe closing has to do.
+        } else {
+          epoll_ctl(epoll_, EPOLL_CTL_DEL, child.out, nullptr);
+        }
+      }
+    }
+    return watched;
+  }
+
+  size_t size() const { return children_.size(); }
+
+ private:
+  struct Child {
+    int out;
+    int pidfd;  // -1 if pidfd_open() is not available.
+    string output;
+  };
+
+  // epoll keys: the pid and whether it is the pidfd (rather than the pipe).
+  static const uint64_t kWatched = ~0ULL;
+  static uint64_t key(pid_t pid, bool pidfd) {
+    return static_cast<uint64_t>(pid) << 1 | (pidfd ? 1 : 0);
+  }
+  void add(int fd, uint64_t key) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = key;
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+  }
+  // Reads what is in the pipe.  Returns whether it reached EOF.
+  bool drain(Child* child) {
+    char buffer[4096];
+    for (;;) {
+      const ssize_t n = read(child->out, buffer, sizeof(buffer));
+      if (n > 0) {
+        child->output.append(buffer, static_cast<size_t>(n));
+      } else if (n == -1 && errno == EINTR) {
+        continue;
+      } else {
+        return n == 0;
+      }
+    }
+  }
+  void reap(std::map<pid_t, Child>::iterator it, vector<Finished>* finished) {
+    Child& child = it->second;
+    drain(&child);
+    Finished done{it->first, 0, {}, std::move(child.output)};
+    if (os::Wait(done.pid, &done.status, &done.usage) == -1) {
+      done.status = -1;  // Lost; not a success.
+    }
+    close(child.out);  // Also takes it out of the epoll set.
+    if (child.pidfd != -1) {
+      close(child.pidfd);
+    }
+    children_.erase(it);
+    finished->push_back(std::move(done));
+  }
+
+  const int epoll_;
+  std::map<pid_t, Child> children_;
+};
+
+// Modification time of `path' in nanoseconds since the epoch, or -1 if it
+// cannot be stat'ed.
+int64_t ModTime(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+      st.st_mtim.tv_nsec;
+}
+
+// Sets the modification time of `path' to now.
+bool Touch(const string& path) {
+  return utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+}
+
+// Makes `to' a file of its own with the contents of `from': a reflink (a
+// copy-on-write clone) if possible, then a plain copy.  `to' must not exist.
+bool CloneOrCopy(const string& from, const string& to) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    return false;
+  }
+  struct stat st;
+  int out = -1;
+  if (fstat(in, &st) == 0) {
+    out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+               st.st_mode & 0777);
+  }
+  if (out == -1) {
+    close(in);
+    return false;
+  }
+  bool ok = ioctl(out, FICLONE, in) == 0;
+  if (!ok) {
+    char buffer[1 << 16];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0 &&
+           write(out, buffer, static_cast<size_t>(n)) == n) {
+    }
+    ok = n == 0;
+  }
+  close(in);
+  if (close(out) != 0 || !ok) {
+    unlink(to.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Like CloneOrCopy(), but a hard link if possible.
+bool LinkOrCopy(const string& from, const string& to) {
+  return link(from.c_str(), to.c_str()) == 0 || CloneOrCopy(from, to);
+}
+
+// Microseconds on the monotonic clock.
+int64_t NowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Number of online processors, at least 1.
+size_t NumCpus() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : static_cast<size_t>(n);
+}
+
 class Runtime {
  public:
   Runtime(int argc, char* argv[], char** envp) {
@@ -36,6 +36,271 @@ TEST(Eden, ReadPrint) {
   }
 }
 
+TEST(Eden, WriteCompact) {
+  const eden::Tree root = eden::read(
+      "(aa.bb (b) {:a 1 :b \"q\\\"s\\\\\"}) {:k x} [\\space 1.5 nil]");
+  ASSERT_NE(nullptr, root);
+  const std::string want =
+      "[(aa.bb (b) {:a 1 :b \"q\\\"s\\\\\"}) {:k x} [\\space 1.5 nil]]";
+  std::string got = "> ";
+  eden::Writer(&got, eden::Writer::Style::Compact).Write(*root);
+  EXPECT_EQ("> " + want, got);
+  EXPECT_EQ(eden::pprint(*root),
+            eden::pprint(*eden::read(got.substr(2))->AsNodes()[0]));
+
+  std::ostringstream stream;
+  {
+    eden::Writer writer(&stream, eden::Writer::Style::Pretty);
+    for (size_t i = 0; i < 10000; ++i) {
+      writer.Write(*root);
+    }
+  }
+  const std::string pretty = eden::pprint(*root);
+  ASSERT_EQ(10000 * pretty.size(), stream.str().size());
+  EXPECT_EQ(pretty, stream.str().substr(9999 * pretty.size()));
+}
+
+TEST(Eden, ReadAcrossBlocks) {
+  // Tokens, strings and comments longer than the scanner's blocks, with the
+  // interesting bytes at and around the block edges.
+  const string long_symbol(100, 'x');
+  const string long_string = string(31, 'a') + "\\\"" + string(40, 'b');
+  const string in = "(" + long_symbol + " \"" + long_string + "\"" +
+                    string(33, ' ') + ";" + string(70, 'c') + "\n" +
+                    ":" + long_symbol + ",,\"\")";
+  const eden::Tree root = eden::read(in);
+  ASSERT_NE(nullptr, root);
+  const eden::Nodes& list = root->AsNodes()[0]->AsNodes();
+  ASSERT_EQ(4u, list.size());
+  EXPECT_EQ(long_symbol, list[0]->AsString());
+  EXPECT_EQ(string(31, 'a') + "\"" + string(40, 'b'), list[1]->AsString());
+  EXPECT_TRUE(list[2]->IsKeyword());
+  EXPECT_EQ(long_symbol, list[2]->AsString());
+  EXPECT_EQ("", list[3]->AsString());
+}
+
+TEST(Eden, ReadErrors) {
+  EXPECT_EQ(nullptr, eden::read("(a \"b"));
+  EXPECT_EQ(nullptr, eden::read("(a \"b\\"));
+  EXPECT_EQ(nullptr, eden::read("(a b"));
+  EXPECT_EQ(nullptr, eden::read("a b)"));
+  EXPECT_EQ(nullptr, eden::read("(a]"));
+  EXPECT_EQ(nullptr, eden::read("{a)"));
+  EXPECT_EQ(nullptr, eden::read("#{a)"));
+}
+
+TEST(Eden, ReadScalars) {
+  const eden::Tree root = eden::read(
+      "1 -2 +3 1.5 -0.25 1e3 10ms 99999999999999999999 - true false nil "
+      "\"fits in a node\" \"does not fit in a node\"");
+  ASSERT_NE(nullptr, root);
+  const eden::Nodes nodes = root->AsNodes();
+  ASSERT_EQ(14u, nodes.size());
+  EXPECT_EQ(1, nodes[0]->AsInt());
+  EXPECT_EQ(-2, nodes[1]->AsInt());
+  EXPECT_EQ(3, nodes[2]->AsInt());
+  EXPECT_EQ(1.5, nodes[3]->AsFloat());
+  EXPECT_EQ(-0.25, nodes[4]->AsFloat());
+  EXPECT_EQ(1000.0, nodes[5]->AsFloat());
+  EXPECT_TRUE(nodes[6]->IsSymbol());
+  // Too big for an int64.
+  EXPECT_EQ(1e20, nodes[7]->AsFloat());
+  EXPECT_TRUE(nodes[8]->IsSymbol());
+  EXPECT_TRUE(nodes[9]->AsBool());
+  EXPECT_FALSE(nodes[10]->AsBool());
+  EXPECT_TRUE(nodes[11]->IsNil());
+  EXPECT_EQ("fits in a node", nodes[12]->AsString());
+  EXPECT_EQ("does not fit in a node", nodes[13]->AsString());
+  // Other types have no string.
+  EXPECT_EQ("", nodes[11]->AsString());
+  EXPECT_EQ("", eden::Node::Int(3).AsString());
+  EXPECT_EQ("[[1\n  1.5\n  1000.0\n  -2]]",
+            eden::pprint(*eden::read("[1 1.5 1e3 -2]")));
+}
+
+// An AA file in small, for the tests that take a whole file.
+const std::string kAa =
+    ";; Module attributes.\n"
+    "{:cflags-default [\"-O2\" \"-Wall\"]\n"
+    " :out-dir \"./.out/\"}\n"
+    "\n"
+    "eden (c++lib []\n"
+    "      {:src [\"eden.cc\"]\n"
+    "       :hdr [\"eden.h\"]\n"
+    "       :inc [\"string\" \"vector\"]})\n"
+    "\n"
+    "aa (c++bin [eden]  ; A comment.\n"
+    "    {:src [\"aa.cc\"] :msg \"say \\\"hi\\\"\\n\"\n"
+    "     :n 3 :f -1.5 :c \\a :on true :off nil :set #{x y}})\n";
+
+TEST(Eden, EncodeDecode) {
+  const eden::Tree root = eden::read(kAa);
+  ASSERT_NE(nullptr, root);
+  ASSERT_GE(root->AsNodes().size(), 2u);
+  const std::string encoded = eden::encode(*root);
+  ASSERT_NE("", encoded);
+  const eden::Tree decoded = eden::decode(encoded.data(), encoded.size());
+  ASSERT_NE(nullptr, decoded);
+  EXPECT_EQ(eden::pprint(*root), eden::pprint(*decoded));
+  // Names are interned in the decoded tree too.
+  ASSERT_TRUE(root->AsNodes()[1]->IsSymbol());
+  EXPECT_EQ(root->AsNodes()[1]->AsName(),
+            decoded->AsNodes()[1]->AsName());
+
+  for (size_t size = 0; size < encoded.size(); size += 7) {
+    EXPECT_EQ(nullptr, eden::decode(encoded.data(), size));
+  }
+  std::string other_version = encoded;
+  ++other_version[7];
+  EXPECT_EQ(nullptr,
+            eden::decode(other_version.data(), other_version.size()));
+}
+
+TEST(Eden, DecodeRejectsBadInput) {
+  const std::string empty = eden::encode(*eden::read(""));
+  ASSERT_NE("", empty);
+  EXPECT_NE(nullptr, eden::decode(empty.data(), empty.size()));
+  // The magic, then no names.
+  const std::string header = empty.substr(0, empty.size() - 2);
+  const auto decodes = [](const std::string& in) {
+    return eden::decode(in.data(), in.size()) != nullptr;
+  };
+  EXPECT_FALSE(decodes(header + "\x05\x64" "ab"));  // A string of 100 bytes.
+  EXPECT_FALSE(decodes(header + "\x06\x00"));  // Name 0 of 0.
+  EXPECT_FALSE(decodes(header.substr(0, 8) + "\xff\xff\xff\xff\x7f"));
+  EXPECT_FALSE(decodes(header + "\x09\x02\x00"));  // Two items, one there.
+
+  // Nesting is bounded, in both directions.
+  std::string deep = header;
+  for (int i = 0; i < 100000; ++i) {
+    deep += "\x09\x01";  // A vector of one item.
+  }
+  deep += '\x00';
+  EXPECT_FALSE(decodes(deep));
+  const std::string nested = std::string(999, '[') + std::string(999, ']');
+  EXPECT_TRUE(decodes(eden::encode(*eden::read(nested))));
+  EXPECT_EQ("", eden::encode(*eden::read("[" + nested + "]")));
+}
+
+TEST(Eden, MapsAndSets) {
+  // Past Node::kIndexedSize keys, and under it.
+  for (size_t size : {3, 100}) {
+    std::string in = "[{";
+    for (size_t i = 0; i < size; ++i) {
+      in += ":k" + std::to_string(i) + " " + std::to_string(i) + " ";
+    }
+    in += "\"s\" 1.5 -0.0 2 [1 (a)] \\c :k0 first-repeated :k0 last} #{";
+    for (size_t i = 0; i < size; ++i) {
+      in += "m" + std::to_string(i) + " ";
+    }
+    in += "}]";
+    const eden::Tree root = eden::read(in);
+    ASSERT_NE(nullptr, root);
+    const eden::Tree decoded = [&] {
+      const std::string encoded = eden::encode(*root);
+      return eden::decode(encoded.data(), encoded.size());
+    }();
+    ASSERT_NE(nullptr, decoded);
+    for (const eden::Tree* tree : {&root, &decoded}) {
+      const eden::Node& map = *(*tree)->AsNodes()[0]->AsNodes()[0];
+      const eden::Node& set = *(*tree)->AsNodes()[0]->AsNodes()[1];
+      ASSERT_TRUE(map.IsMap());
+      ASSERT_TRUE(set.IsSet());
+      for (size_t i = 1; i < size; ++i) {
+        const eden::Node key =
+            eden::Node::Keyword(eden::Intern("k" + std::to_string(i)));
+        ASSERT_NE(nullptr, map.Get(key));
+        EXPECT_EQ(static_cast<int64_t>(i), map.Get(key)->AsInt());
+        EXPECT_TRUE(set.Contains(
+            eden::Node::Symbol(eden::Intern("m" + std::to_string(i)))));
+      }
+      EXPECT_EQ("last",
+                map.Get(eden::Node::Keyword(eden::Intern("k0")))->AsString());
+      EXPECT_EQ(1.5, map.Get(eden::Node::String("s"))->AsFloat());
+      EXPECT_EQ(2, map.Get(eden::Node::Float(0.0))->AsInt());
+      EXPECT_EQ('c', map.Get(*map.AsNodes()[2 * size + 4])->AsChar());
+      EXPECT_EQ(nullptr, map.Get(eden::Node::Int(0)));
+      EXPECT_EQ(nullptr, map.Get(eden::Node::String("k1")));
+      EXPECT_FALSE(map.Contains(eden::Node::Symbol(eden::Intern("k1"))));
+      EXPECT_FALSE(set.Contains(eden::Node::String("m1")));
+      EXPECT_EQ(nullptr, set.Get(set));
+    }
+  }
+
+  const eden::Tree set = eden::read("#{a b} #{}");
+  ASSERT_NE(nullptr, set);
+  EXPECT_EQ("[#{a\n  b}\n #{}]", eden::pprint(*set));
+
+  eden::Node fields[] = {eden::Node::Int(1), eden::Node::Int(2)};
+  eden::Node* items[] = {&fields[0], &fields[1]};
+  const eden::Node map =
+      eden::Node::Collection(eden::Node::Type::Map, items, 2);
+  EXPECT_EQ(2, map.Get(eden::Node::Int(1))->AsInt());
+  EXPECT_FALSE(map.Contains(eden::Node::Int(2)));
+}
+
+TEST(Eden, ReaderFeedsForms) {
+  const std::string in = kAa + "\n#{a b} \"s\\\"\" sym ; comment\n[1 2] end";
+  const eden::Tree whole = eden::read(in);
+  ASSERT_NE(nullptr, whole);
+  std::vector<std::string> want;
+  for (const eden::Node* form : whole->AsNodes()) {
+    want.push_back(eden::pprint(*form));
+  }
+  for (size_t chunk_size : {size_t{1}, size_t{7}, size_t{64}, in.size()}) {
+    std::vector<std::string> got;
+    eden::Reader reader(
+        [&](eden::Tree form) { got.push_back(eden::pprint(*form)); });
+    for (size_t i = 0; i < in.size(); i += chunk_size) {
+      ASSERT_TRUE(reader.Feed(std::string_view(in).substr(i, chunk_size)))
+          << reader.error();
+    }
+    ASSERT_TRUE(reader.Finish()) << reader.error();
+    EXPECT_EQ(want, got) << "chunks of " << chunk_size;
+  }
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(static_cast<ssize_t>(in.size()),
+            write(fds[1], in.data(), in.size()));
+  close(fds[1]);
+  size_t num_forms = 0;
+  eden::Reader reader([&](eden::Tree) { ++num_forms; });
+  EXPECT_TRUE(reader.ReadFd(fds[0])) << reader.error();
+  close(fds[0]);
+  EXPECT_EQ(whole->AsNodes().size(), num_forms);
+}
+
+TEST(Eden, ReaderErrors) {
+  for (const char* in : {"(a", "a)", "(a]", "\"a", "(a \"b)"}) {
+    eden::Reader reader([](eden::Tree) {});
+    EXPECT_FALSE(reader.Feed(in) && reader.Finish()) << in;
+  }
+}
+
+TEST(Eden, IndexForms) {
+  const std::string in = kAa + "\n#{a b} \"s\\\"\" sym ; comment\n[1 2] end";
+  const eden::Tree whole = eden::read(in);
+  ASSERT_NE(nullptr, whole);
+  std::vector<std::string_view> forms;
+  std::string error;
+  ASSERT_TRUE(eden::IndexForms(in, &forms, &error)) << error;
+  ASSERT_EQ(whole->AsNodes().size(), forms.size());
+  for (size_t i = 0; i < forms.size(); ++i) {
+    EXPECT_GE(forms[i].data(), in.data());
+    EXPECT_LE(forms[i].data() + forms[i].size(), in.data() + in.size());
+    EXPECT_EQ(eden::pprint(*whole->AsNodes()[i]),
+              eden::pprint(*eden::read(forms[i])->AsNodes()[0]));
+  }
+  EXPECT_EQ("end", forms.back());
+
+  for (const char* bad : {"(a", "a)", "\"a", "(a \"b)"}) {
+    forms.clear();
+    EXPECT_FALSE(eden::IndexForms(bad, &forms, &error)) << bad;
+    EXPECT_NE("", error);
+  }
+}
+
 TEST(Eden, AaFromFile) {
   const std::string aa_contents = strings::ReadFileToString("AA");
   const std::string pprinted = eden::pprint(*eden::read(aa_contents));
@@ -1,71 +1,27 @@
 #include "eden.h"
 
 #include <algorithm>
+#include <charconv>
 #include <cstring>
 #include <iostream>
+#include <string_view>
+#include <unordered_map>
 
-namespace eden {
-
-namespace {
-class Reader {
- public:
-  static std::unique_ptr<Node> Read(const std::string& s);
-
- private:
-  enum Context {
-    NORMAL = 0,
-    STRING = 1,
-    ESCAPING_STRING = 2,
-    COMMENT = 3,
-    TOKEN = 4,
-  };
-
-  Reader();
-
-  static int signals(const char c);
-  bool recordToken();
-  void eatParenthesis(const char c);
-  void startMetadataMap();
-  void startEscapableQuote();
-  void startQuote();
-  void startUnquote();
-  bool eat(const char c);
-  std::unique_ptr<Node> release();
-
-  Context context_;
-  std::unique_ptr<Node> root_;
-  std::vector<Node*> coll_stack_;
-  Node::Type token_type_;
-  std::string token_;
-  std::string error_;
-};
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// static
-std::unique_ptr<Node> Reader::Read(const std::string& s) {
-  Reader reader;
-  reader.eat('[');
-  for (const char c : s) {
-    if (!reader.eat(c)) {
-      std::cerr << "Error: " << reader.error_ << "\n";
-      return nullptr;
-    }
-  }
-  if (!reader.eat(']')) {
-    std::cerr << "Error: " << reader.error_ << "\n";
-    return nullptr;
-  }
-  return reader.release();
-}
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-Reader::Reader()
-    : context_(Context::NORMAL),
-      root_(nullptr),
-      token_type_(Node::Type::Nil),
-      token_(""),
-      error_("") {}
+namespace eden {
 
-// static
-int Reader::signals(const char c) {
+namespace {
+int signals(const char c) {
   // [ 0 0 0 0 0 0 0 0 ]
   //           ^ ^ ^ ^
   //           | | | |
@@ -335,7 +291,192 @@ int Reader::signals(const char c) {
   return kSignals[static_cast<uint8_t>(c)];
 }
 
-char CharFromName(const std::string& token) {
+// Block scanning.  Each scanner returns the first byte in [p, end) it stops
+// at.  With SSE2 (or AVX2) the input is classified 16 (or 32) bytes at a time
+// into a bit mask of candidates, a superset of the stop bytes, so runs of
+// plain bytes are skipped a block at a time and only candidates are checked
+// against signals().  Without either, and for the tail, it goes byte by byte.
+#if defined(__AVX2__)
+#define EDEN_BLOCKS 1
+typedef __m256i Block;
+constexpr ptrdiff_t kBlockSize = 32;
+constexpr uint32_t kAllBits = 0xffffffff;
+inline Block load(const char* p) {
+  return _mm256_loadu_si256(reinterpret_cast<const Block*>(p));
+}
+inline Block equal(Block b, char c) {
+  return _mm256_cmpeq_epi8(b, _mm256_set1_epi8(c));
+}
+// Signed, so bytes >= 128 are below everything.
+inline Block below(Block b, char c) {
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8(c), b);
+}
+inline Block either(Block a, Block b) { return _mm256_or_si256(a, b); }
+inline uint32_t bits(Block b) {
+  return static_cast<uint32_t>(_mm256_movemask_epi8(b));
+}
+#elif defined(__SSE2__)
+#define EDEN_BLOCKS 1
+typedef __m128i Block;
+constexpr ptrdiff_t kBlockSize = 16;
+constexpr uint32_t kAllBits = 0xffff;
+inline Block load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const Block*>(p));
+}
+inline Block equal(Block b, char c) {
+  return _mm_cmpeq_epi8(b, _mm_set1_epi8(c));
+}
+inline Block below(Block b, char c) {
+  return _mm_cmpgt_epi8(_mm_set1_epi8(c), b);
+}
+inline Block either(Block a, Block b) { return _mm_or_si128(a, b); }
+inline uint32_t bits(Block b) {
+  return static_cast<uint32_t>(_mm_movemask_epi8(b));
+}
+#endif
+
+#ifdef EDEN_BLOCKS
+template <typename Candidates, typename Stop>
+const char* scan(const char* p, const char* end, Candidates candidates,
+                 Stop stop) {
+  for (; end - p >= kBlockSize; p += kBlockSize) {
+    for (uint32_t m = candidates(load(p)); m != 0; m &= m - 1) {
+      const char* q = p + __builtin_ctz(m);
+      if (stop(*q)) {
+        return q;
+      }
+    }
+  }
+  while (p < end && !stop(*p)) {
+    ++p;
+  }
+  return p;
+}
+#else
+template <typename Candidates, typename Stop>
+const char* scan(const char* p, const char* end, Candidates, Stop stop) {
+  while (p < end && !stop(*p)) {
+    ++p;
+  }
+  return p;
+}
+#endif
+
+#ifdef EDEN_BLOCKS
+#define EDEN_CANDIDATES(b, expr) [](Block b) -> uint32_t { return expr; }
+#else
+#define EDEN_CANDIDATES(b, expr) nullptr
+#endif
+
+// Past whitespace and commas.
+const char* skipWhitespace(const char* p, const char* end) {
+  // Most tokens are followed by one space or none; don't set up blocks.
+  if (p < end && (signals(*p) & 4) == 0) {
+    return p;
+  }
+  if (++p < end && (signals(*p) & 4) == 0) {
+    return p;
+  }
+  return scan(
+      p, end,
+      EDEN_CANDIDATES(b, ~bits(either(
+          either(equal(b, ' '), equal(b, '\n')),
+          either(either(equal(b, '\t'), equal(b, '\r')), equal(b, ',')))) &
+          kAllBits),
+      [](char c) { return (signals(c) & 4) == 0; });
+}
+
+// Past the token characters.  Everything from '!' to '~' is one, but for
+// the paren-ish and control characters listed here.
+const char* tokenEnd(const char* p, const char* end) {
+  return scan(
+      p, end,
+      EDEN_CANDIDATES(b, bits(either(
+          either(either(either(below(b, '!'), equal(b, '\x7f')),
+                        either(equal(b, '"'), equal(b, '#'))),
+                 either(either(equal(b, '&'), equal(b, '\'')),
+                        either(equal(b, '('), equal(b, ')')))),
+          either(either(either(equal(b, ','), equal(b, ';')),
+                        either(equal(b, '['), equal(b, ']'))),
+                 either(either(equal(b, '^'), equal(b, '`')),
+                        either(either(equal(b, '{'), equal(b, '}')),
+                               equal(b, '~'))))))),
+      [](char c) { return (signals(c) & 1) == 0; });
+}
+
+// At the closing quote or the next backslash of a string.
+const char* stringEnd(const char* p, const char* end) {
+  return scan(
+      p, end,
+      EDEN_CANDIDATES(b, bits(either(equal(b, '"'), equal(b, '\\')))),
+      [](char c) { return c == '"' || c == '\\'; });
+}
+
+const char* lineEnd(const char* p, const char* end) {
+  return scan(p, end, EDEN_CANDIDATES(b, bits(equal(b, '\n'))),
+              [](char c) { return c == '\n'; });
+}
+
+class Parser {
+ public:
+  // The forms in [p, end), in a vector.
+  static Tree Read(const char* p, const char* end, std::string* error);
+
+ private:
+  explicit Parser(size_t input_size);
+
+  bool eatAll(const char* p, const char* end);
+  const char* eatString(const char* p, const char* end);
+  Node* createNodeFromToken(Node::Type type, std::string_view token);
+  void recordToken(Node::Type type, std::string_view token);
+  bool eatParenthesis(const char c);
+  void openCollection(Node::Type type);
+  void closeCollection();
+  void startMetadataMap();
+  void startEscapableQuote();
+  void startQuote();
+  void startUnquote();
+  Tree release();
+
+  std::unique_ptr<Arena> arena_;
+  Node* root_;
+  // The collections being read, outermost first, with where their items
+  // start in items_.
+  std::vector<std::pair<Node*, size_t>> coll_stack_;
+  // The items read so far of all collections in coll_stack_.  A collection's
+  // are copied into the arena in one piece when it closes.
+  std::vector<Node*> items_;
+  std::string error_;
+};
+
+// static
+Tree Parser::Read(const char* p, const char* end, std::string* error) {
+  Parser parser(static_cast<size_t>(end - p));
+  parser.eatParenthesis('[');
+  if (!parser.eatAll(p, end)) {
+    *error = parser.error_;
+    return nullptr;
+  }
+  if (parser.coll_stack_.size() != 1) {
+    *error = "Unclosed " + parser.coll_stack_.back().first->Typename();
+    return nullptr;
+  }
+  parser.closeCollection();
+  return parser.release();
+}
+
+// A tree takes a few times the size of its text; small ones (as the forms
+// of a Reader) should not each take a whole default block, and large ones
+// should go straight to the (spare) full-size blocks.
+Parser::Parser(size_t input_size)
+    : arena_(std::make_unique<Arena>(
+          std::min<size_t>(Arena::kMaxBlock, 256 + 4 * input_size))),
+      root_(nullptr),
+      error_("") {}
+
+bool isDigit(char c) { return '0' <= c && c <= '9'; }
+
+char CharFromName(std::string_view token) {
   if (token.size() < 2) {
     return '\0';
   }
@@ -373,231 +514,691 @@ char CharFromName(const std::string& token) {
       '\0';
 }
 
-Node* CreateNodeFromToken(const Node::Type type, const std::string& token) {
-  auto* node = new Node();
-  if (type == Node::Type::String) {
-    node->type = type;
-    node->value = static_cast<void*>(new std::string(token));
-    return node;
-  }
-  if (type != Node::Type::Symbol || token.size() < 1) {
-    return nullptr;
-  }
-  const char first_char = token[0];
+} // ::
 
-  if (first_char == '\\') {
-    node->type = Node::Type::Char;
-    node->value = static_cast<void*>(new char(CharFromName(token)));
-    return node;
+namespace {
+// The interned names, open-addressed by an FNV-1a hash and at most half full.
+// Tokens are short, so the hash is cheaper than std::hash's, and a probe is
+// one compare of the stored hash for all but the name it finds.
+struct InternTable {
+  struct Slot {
+    uint64_t hash;
+    const std::string* name;
+  };
+
+  static uint64_t Hash(std::string_view name) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (const char c : name) {
+      h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+    return h;
   }
 
-  if (first_char == ':') {
-    node->type = Node::Type::Keyword;
-    node->value = static_cast<void*>(new std::string(token.substr(1)));
-    return node;
+  Slot* Find(std::string_view name, uint64_t hash) {
+    const size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot& slot = slots[i];
+      if (slot.name == nullptr ||
+          (slot.hash == hash && *slot.name == name)) {
+        return &slot;
+      }
+    }
   }
 
-  // Starts with a digit or (- or +) followed by a digit.
-  if (('0' <= first_char && first_char <= '9') ||
-      (token.size() > 1 &&
-       (first_char == '+' || first_char == '-') &&
-       '0' <= token[1] && token[1] <= '9')) {
-    // TODO: Parse number (integer or float, possibly with width and unit).
-    node->type = Node::Type::Int;
-    node->value = static_cast<void*>(new std::string(token));
+  void Grow() {
+    std::vector<Slot> old(2 * slots.size());
+    old.swap(slots);
+    for (const Slot& slot : old) {
+      if (slot.name != nullptr) {
+        *Find(*slot.name, slot.hash) = slot;
+      }
+    }
   }
 
-  node->type = type;
-  node->value = static_cast<void*>(new std::string(token));
-  return node;
+  std::vector<Slot> slots = std::vector<Slot>(4096);
+  std::vector<std::unique_ptr<const std::string>> names;
+};
+
+InternTable& internTable() {
+  static InternTable table;
+  return table;
 }
+} // ::
 
-bool Reader::recordToken() {
-  Node* token_node = CreateNodeFromToken(token_type_, token_);
-  if (token_node == nullptr) {
-    return false;
+const std::string* Intern(std::string_view name) {
+  InternTable& table = internTable();
+  const uint64_t hash = InternTable::Hash(name);
+  InternTable::Slot* slot = table.Find(name, hash);
+  if (slot->name != nullptr) {
+    return slot->name;
   }
-  coll_stack_.back()->AsNodesMut()->push_back(token_node);
-  token_type_ = Node::Type::Nil;
-  token_ = "";
-  return true;
+  table.names.push_back(std::make_unique<const std::string>(name));
+  *slot = {hash, table.names.back().get()};
+  if (2 * table.names.size() > table.slots.size()) {
+    table.Grow();
+  }
+  return table.names.back().get();
 }
 
-void Reader::eatParenthesis(const char c) {
-  if (c == '(' || c == '[' || c == '{') { // open paren
-    auto* node = new Node();
-    node->type = (c == '(') ? Node::Type::List :
-                 (c == '[') ? Node::Type::Vector :
-                 /* c == '{' */ Node::Type::Map;
-    node->value = new std::vector<Node*>;
-    if (root_ == nullptr) {
-      root_.reset(node);
-    } else {
-      coll_stack_.back()->AsNodesMut()->push_back(node);
-    }
-    coll_stack_.push_back(node);
-  } else if (c == ')' || c == ']' || c == '}') { // close paren
-    auto* coll = coll_stack_.back();
-    Node::Type expected_type = (c == ')') ? Node::Type::List :
-                               (c == ']') ? Node::Type::Vector :
-                               /* c == '}' */ Node::Type::Map;
-    if (coll->type != expected_type) {
-        std::cerr << "Mismatched parens.  Tried to close a " << coll->Typename()
-                  << " with a '" << c << "'.";
+const std::string* Interned(std::string_view name) {
+  return internTable().Find(name, InternTable::Hash(name))->name;
+}
+
+namespace {
+// Up to 16 MiB of kMaxBlock blocks of Arenas that are gone.
+std::vector<std::unique_ptr<char[]>>& spareBlocks() {
+  static std::vector<std::unique_ptr<char[]>> blocks;
+  return blocks;
+}
+constexpr size_t kMaxSpareBlocks = 16;
+} // ::
+
+Arena::~Arena() {
+  for (Finalizer* f = finalizers_; f != nullptr; f = f->next) {
+    f->destroy(f->object);
+  }
+  auto& spare = spareBlocks();
+  for (auto& [block, size] : blocks_) {
+    if (size == kMaxBlock && spare.size() < kMaxSpareBlocks) {
+      spare.push_back(std::move(block));
     }
-    coll_stack_.pop_back();
+  }
+}
+
+void Arena::grow(size_t at_least) {
+  const size_t size = std::max(block_size_, at_least);
+  block_size_ = std::min(2 * block_size_, kMaxBlock);
+  auto& spare = spareBlocks();
+  if (size == kMaxBlock && !spare.empty()) {
+    blocks_.emplace_back(std::move(spare.back()), size);
+    spare.pop_back();
   } else {
-    std::cerr << "Unknown paren '" << c << "'.";
+    blocks_.emplace_back(new char[size], size);
   }
+  next_ = blocks_.back().first.get();
+  end_ = next_ + size;
 }
 
-void Reader::startMetadataMap() {
+namespace {
+// Floats are keys by their bits, but for -0.0, which is 0.0.
+uint64_t floatKey(double f) {
+  f += 0.0;
+  uint64_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
 }
 
-void Reader::startEscapableQuote() {
+size_t hashNode(const Node& node) {
+  const size_t type = static_cast<size_t>(node.type());
+  switch (node.type()) {
+    case Node::Type::Nil:
+      return 0;
+    case Node::Type::Bool:
+      return type ^ (node.AsBool() ? 1 : 0);
+    case Node::Type::Char:
+      return type * 31 + static_cast<uint8_t>(node.AsChar());
+    case Node::Type::Int:
+      return type ^ std::hash<int64_t>()(node.AsInt());
+    case Node::Type::Float:
+      return type ^ std::hash<uint64_t>()(floatKey(node.AsFloat()));
+    case Node::Type::String:
+      return type ^ std::hash<std::string_view>()(node.AsString());
+    case Node::Type::Symbol:
+    case Node::Type::Keyword:
+      return type ^ std::hash<const std::string*>()(node.AsName());
+    default:
+      break;
+  }
+  size_t h = type;
+  for (const Node* item : node.AsNodes()) {
+    h = h * 31 + hashNode(*item);
+  }
+  return h;
 }
 
-void Reader::startQuote() {
+bool equalNodes(const Node& a, const Node& b) {
+  if (a.type() != b.type()) {
+    return false;
+  }
+  switch (a.type()) {
+    case Node::Type::Nil:
+      return true;
+    case Node::Type::Bool:
+      return a.AsBool() == b.AsBool();
+    case Node::Type::Char:
+      return a.AsChar() == b.AsChar();
+    case Node::Type::Int:
+      return a.AsInt() == b.AsInt();
+    case Node::Type::Float:
+      return floatKey(a.AsFloat()) == floatKey(b.AsFloat());
+    case Node::Type::String:
+      return a.AsString() == b.AsString();
+    case Node::Type::Symbol:
+    case Node::Type::Keyword:
+      return a.AsName() == b.AsName();
+    default:
+      break;
+  }
+  const Nodes as = a.AsNodes();
+  const Nodes bs = b.AsNodes();
+  if (as.size() != bs.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < as.size(); ++i) {
+    if (!equalNodes(*as[i], *bs[i])) {
+      return false;
+    }
+  }
+  return true;
 }
 
-void Reader::startUnquote() {
+// A map's keys are every other item; a set's, every item.
+size_t keyStride(Node::Type type) {
+  return type == Node::Type::Map ? 2 : 1;
 }
 
-bool Reader::eat(const char c) {
-  int s = signals(c);
-  if (context_ == Context::STRING) {
-    if (c == '\\') {
-      context_ = Context::ESCAPING_STRING;
-    } else if (c == '"') {
-      context_ = Context::NORMAL;
-      recordToken();
-    } else {
-      token_ += c;
-    }
-    return true;
+// The number of keys of a map or set big enough to index, or 0.
+size_t indexedKeys(Node::Type type, size_t size) {
+  if (type != Node::Type::Map && type != Node::Type::Set) {
+    return 0;
   }
+  const size_t keys = size / keyStride(type);
+  return keys > Node::kIndexedSize ? keys : 0;
+}
 
-  if (context_ == Context::ESCAPING_STRING) {
-    context_ = Context::STRING;
-    token_ += (c == 'n' ? '\n' :
-               c == 't' ? '\t' :
-               c == 'r' ? '\r' :
-               c == 'f' ? '\f' :
-               c);
-    return true;
+// Slots of the open-addressing index, at most half full.  Each holds 1 + the
+// number of the key in it, or 0.
+size_t indexSlots(size_t keys) {
+  size_t slots = 2 * Node::kIndexedSize;
+  while (slots < 2 * keys) {
+    slots *= 2;
   }
+  return slots;
+}
+} // ::
 
-  if (context_ == Context::COMMENT) {
-    if (c == '\n') {
-      context_ = Context::NORMAL;
-    }
-    return true;
+// static
+Node** Node::NewItems(Arena* arena, Type type, size_t size) {
+  size_t bytes = size * sizeof(Node*);
+  if (const size_t keys = indexedKeys(type, size); keys != 0) {
+    bytes += indexSlots(keys) * sizeof(uint32_t);
   }
+  return static_cast<Node**>(arena->Allocate(bytes, alignof(Node*)));
+}
 
-  if (s & 1) {
-    if (context_ == Context::NORMAL) {
-      context_ = Context::TOKEN;
-      token_type_ = Node::Type::Symbol;
-      token_ = "";
+// static
+Node Node::IndexedCollection(Type type, Node** items, size_t size) {
+  Node node = Collection(type, items, size);
+  const size_t keys = indexedKeys(type, size);
+  if (keys == 0) {
+    return node;
+  }
+  const size_t stride = keyStride(type);
+  const size_t mask = indexSlots(keys) - 1;
+  uint32_t* slots = reinterpret_cast<uint32_t*>(items + size);
+  std::fill(slots, slots + mask + 1, 0);
+  for (size_t k = 0; k < keys; ++k) {
+    const Node& key = *items[k * stride];
+    size_t i = hashNode(key) & mask;
+    while (slots[i] != 0 && !equalNodes(*items[(slots[i] - 1) * stride], key)) {
+      i = (i + 1) & mask;
     }
-    token_ += c;
-    return true;
+    slots[i] = static_cast<uint32_t>(k + 1);  // A repeated key takes over.
   }
+  node.out_.indexed = true;
+  return node;
+}
 
-  // s & 1 == 0, context is either NORMAL or TOKEN.
-
-  if (s & 4) { // whitespace
-    if (context_ == Context::NORMAL) { // more whitespace
-      return true;
+Node* const* Node::find(const Node& key) const {
+  if (type() != Type::Map && type() != Type::Set) {
+    return nullptr;
+  }
+  const size_t stride = keyStride(type());
+  if (out_.indexed) {
+    const size_t mask = indexSlots(out_.size / stride) - 1;
+    const uint32_t* slots =
+        reinterpret_cast<const uint32_t*>(out_.items + out_.size);
+    for (size_t i = hashNode(key) & mask; slots[i] != 0; i = (i + 1) & mask) {
+      Node* const* item = out_.items + (slots[i] - 1) * stride;
+      if (equalNodes(**item, key)) {
+        return item;
+      }
     }
-    if (context_ == Context::TOKEN) { // control-ish
-      recordToken();
-      context_ = Context::NORMAL;
-      return true;
+    return nullptr;
+  }
+  for (size_t k = out_.size / stride; k-- > 0;) {
+    if (equalNodes(*out_.items[k * stride], key)) {
+      return out_.items + k * stride;
     }
-    std::cerr << "Unexpected context for a whitespace\n";
   }
+  return nullptr;
+}
 
-  if (context_ == Context::TOKEN) { // control-ish
-    recordToken(); // Do not return, we need to react to `c' further down.
+const Node* Node::Get(const Node& key) const {
+  if (!IsMap()) {
+    return nullptr;
   }
+  Node* const* item = find(key);
+  return item == nullptr ? nullptr : item[1];
+}
 
-  if (c == '"') {
-    context_ = Context::STRING;
-    token_type_ = Node::Type::String;
-    token_ = "";
-    return true;
+bool Node::Contains(const Node& key) const {
+  return find(key) != nullptr;
+}
+
+namespace {
+// `token' is a slice of the input; strings too long to fit in the Node are
+// copied into the arena.
+Node* Parser::createNodeFromToken(const Node::Type type,
+                                  std::string_view token) {
+  if (type == Node::Type::String) {
+    return arena_->New<Node>(Node::String(
+        token.size() <= Node::kInlineSize ? token : arena_->Copy(token)));
   }
+  const char first_char = token[0];
 
-  if (c == ';') {
-    context_ = Context::COMMENT;
-    return true;
+  if (first_char == '\\') {
+    return arena_->New<Node>(Node::Char(CharFromName(token)));
   }
 
-  if (s & 2) { // Paren start or end
-    eatParenthesis(c);
-    context_ = Context::NORMAL;
-    return true;
+  if (first_char == ':') {
+    return arena_->New<Node>(Node::Keyword(Intern(token.substr(1))));
   }
 
-  if (c == '#') {
-    //// context_ = Context::Normal;
-    return true;
+  // Starts with a digit or (- or +) followed by a digit.  What does not parse
+  // as a whole into an int64 or a double (say, 10ms) stays a symbol.
+  if (isDigit(first_char) ||
+      (token.size() > 1 && (first_char == '+' || first_char == '-') &&
+       isDigit(token[1]))) {
+    const char* begin = token.data() + (first_char == '+' ? 1 : 0);
+    const char* end = token.data() + token.size();
+    int64_t i;
+    if (auto r = std::from_chars(begin, end, i);
+        r.ec == std::errc() && r.ptr == end) {
+      return arena_->New<Node>(Node::Int(i));
+    }
+    double f;
+    if (auto r = std::from_chars(begin, end, f);
+        r.ec == std::errc() && r.ptr == end) {
+      return arena_->New<Node>(Node::Float(f));
+    }
   }
 
-  if (c == '^') {
-    startMetadataMap();
-    context_ = Context::NORMAL;
-    return true;
+  if (token == "nil") {
+    return arena_->New<Node>();
+  }
+  if (token == "true" || token == "false") {
+    return arena_->New<Node>(Node::Bool(token == "true"));
   }
+  return arena_->New<Node>(Node::Symbol(Intern(token)));
+}
 
-  if (c == '`') {
-    startEscapableQuote();
-    context_ = Context::NORMAL;
-    return true;
+bool Parser::eatAll(const char* p, const char* end) {
+  while ((p = skipWhitespace(p, end)) < end) {
+    const char c = *p;
+    const int s = signals(c);
+    if (s & 1) {
+      const char* token_end = tokenEnd(p + 1, end);
+      recordToken(Node::Type::Symbol,
+                  std::string_view(p, static_cast<size_t>(token_end - p)));
+      p = token_end;
+      continue;
+    }
+    if (c == '"') {
+      if ((p = eatString(p + 1, end)) == nullptr) {
+        return false;
+      }
+      continue;
+    }
+    if (c == ';') {
+      p = lineEnd(p + 1, end);
+      continue;
+    }
+    ++p;
+    if (s & 2) { // Paren start or end
+      if (!eatParenthesis(c)) {
+        return false;
+      }
+    } else if (c == '#') {
+      if (p < end && *p == '{') {
+        ++p;
+        openCollection(Node::Type::Set);
+      }
+    } else if (c == '^') {
+      startMetadataMap();
+    } else if (c == '`') {
+      startEscapableQuote();
+    } else if (c == '\'') {
+      startQuote();
+    } else if (c == '~') {
+      startUnquote();
+    } else {
+      error_ = "Unexpected character \\o" +
+               std::to_string(static_cast<uint8_t>(c) >> 6) +
+               std::to_string(static_cast<uint8_t>(c) >> 3 & 7) +
+               std::to_string(c & 7);
+      return false;
+    }
   }
+  return true;
+}
 
-  if (c == '\'') {
-    startQuote();
-    context_ = Context::NORMAL;
-    return true;
+// `p' is just past the opening quote.  Returns the position past the closing
+// one.  Strings without escapes are sliced straight out of the input.
+const char* Parser::eatString(const char* p, const char* end) {
+  const char* q = stringEnd(p, end);
+  if (q < end && *q == '"') {
+    recordToken(Node::Type::String,
+                std::string_view(p, static_cast<size_t>(q - p)));
+    return q + 1;
+  }
+  std::string value;
+  for (;;) {
+    value.append(p, q);
+    if (q < end && *q == '"') {
+      break;
+    }
+    if (q == end || q + 1 == end) {
+      error_ = "Unterminated string";
+      return nullptr;
+    }
+    const char c = q[1];
+    value += (c == 'n' ? '\n' :
+              c == 't' ? '\t' :
+              c == 'r' ? '\r' :
+              c == 'f' ? '\f' :
+              c);
+    p = q + 2;
+    q = stringEnd(p, end);
   }
+  recordToken(Node::Type::String, value);
+  return q + 1;
+}
 
-  if (c == '~') {
-    startUnquote();
-    context_ = Context::NORMAL;
-    return true;
+void Parser::recordToken(Node::Type type, std::string_view token) {
+  items_.push_back(createNodeFromToken(type, token));
+}
+
+bool Parser::eatParenthesis(const char c) {
+  if (c == '(' || c == '[' || c == '{') { // open paren
+    openCollection((c == '(') ? Node::Type::List :
+                   (c == '[') ? Node::Type::Vector :
+                   /* c == '{' */ Node::Type::Map);
+  } else if (c == ')' || c == ']' || c == '}') { // close paren
+    if (coll_stack_.size() == 1) {
+      error_ = std::string("Unmatched '") + c + "'";
+      return false;
+    }
+    auto* coll = coll_stack_.back().first;
+    Node::Type expected_type = (c == ')') ? Node::Type::List :
+                               (c == ']') ? Node::Type::Vector :
+                               /* c == '}' */ Node::Type::Map;
+    if (coll->type() != expected_type && !(c == '}' && coll->IsSet())) {
+      error_ = "Mismatched parens: tried to close a " + coll->Typename() +
+               " with a '" + c + "'";
+      return false;
+    }
+    closeCollection();
+  } else {
+    error_ = std::string("Unknown paren '") + c + "'";
+    return false;
   }
+  return true;
+}
 
-  std::cerr << "Unknown state: {:context " << context_
-            << ", :char '" << c << "'}\n";
-  exit(1);
+void Parser::openCollection(Node::Type type) {
+  auto* node = arena_->New<Node>(Node::Collection(type, nullptr, 0));
+  if (root_ == nullptr) {
+    root_ = node;
+  } else {
+    items_.push_back(node);
+  }
+  coll_stack_.emplace_back(node, items_.size());
+}
+
+void Parser::closeCollection() {
+  Node* coll = coll_stack_.back().first;
+  const size_t start = coll_stack_.back().second;
+  const size_t size = items_.size() - start;
+  Node** data = Node::NewItems(arena_.get(), coll->type(), size);
+  std::copy(items_.begin() + static_cast<ptrdiff_t>(start), items_.end(),
+            data);
+  *coll = Node::IndexedCollection(coll->type(), data, size);
+  items_.resize(start);
+  coll_stack_.pop_back();
+}
+
+void Parser::startMetadataMap() {
+}
+
+void Parser::startEscapableQuote() {
+}
+
+void Parser::startQuote() {
 }
 
-std::unique_ptr<Node> Reader::release() {
-  return std::move(root_);
+void Parser::startUnquote() {
+}
+
+Tree Parser::release() {
+  return Tree(root_, TreeDeleter{arena_.release()});
 }
 } // ::
 
-std::unique_ptr<Node> read(const std::string& s) {
-  return Reader::Read(s);
+Tree read(std::string_view s) {
+  std::string error;
+  Tree root = Parser::Read(s.data(), s.data() + s.size(), &error);
+  if (root == nullptr) {
+    std::cerr << "Error: " << error << "\n";
+  }
+  return root;
 }
 
-namespace {
-std::string escapeQuotes(const std::string& before) {
-  std::string after;
-  after.reserve(before.length() + 4);
-  for (std::string::size_type i = 0; i < before.length(); ++i) {
-    const char c = before[i];
-    if (c == '"' || c == '\\') {
-        after += '\\';
+Reader::Reader(FormHandler on_form) : on_form_(std::move(on_form)) {}
+
+bool Reader::Feed(std::string_view chunk) {
+  if (!error_.empty()) {
+    return false;
+  }
+  // Scan the chunk where it is, unless there is an unfinished form to
+  // continue.  Either way, only an unfinished form is kept.
+  const bool in_place = buffer_.empty();
+  if (!in_place) {
+    buffer_.append(chunk);
+  }
+  const char* begin = in_place ? chunk.data() : buffer_.data();
+  const char* end = begin + (in_place ? chunk.size() : buffer_.size());
+  const bool ok = scan(begin, end);
+  const size_t keep = form_start_ == kNone ? scanned_ : form_start_;
+  if (in_place) {
+    buffer_.assign(begin + keep, end);
+  } else {
+    buffer_.erase(0, keep);
+  }
+  scanned_ -= keep;
+  if (form_start_ != kNone) {
+    form_start_ -= keep;
+  }
+  return ok;
+}
+
+bool Reader::Finish() {
+  if (!error_.empty()) {
+    return false;
+  }
+  if (state_ == State::Token && depth_ == 0) {
+    // A symbol at the very end.
+    state_ = State::Normal;
+    return emit(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+  if (state_ == State::String || state_ == State::Escape) {
+    error_ = "Unterminated string";
+  } else if (depth_ > 0) {
+    error_ = "Unclosed collection";
+  }
+  return error_.empty();
+}
+
+bool IndexForms(std::string_view text, std::vector<std::string_view>* forms,
+                std::string* error) {
+  Reader reader(nullptr);
+  reader.spans_ = forms;
+  // Fed in one piece, the forms are slices of `text', but for a symbol at
+  // the very end, which the Reader keeps a copy of until Finish().
+  bool ok = reader.Feed(text);
+  if (ok && reader.state_ == Reader::State::Token && reader.depth_ == 0) {
+    forms->push_back(text.substr(text.size() - reader.buffer_.size()));
+    reader.state_ = Reader::State::Normal;
+  }
+  ok = ok && reader.Finish();
+  *error = reader.error_;
+  return ok;
+}
+
+bool Reader::ReadFd(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, size, MADV_SEQUENTIAL);
+      const bool ok = Feed(std::string_view(static_cast<const char*>(data),
+                                            size));
+      munmap(data, size);
+      return ok && Finish();
+    }
+  }
+  char chunk[1 << 16];
+  ssize_t n;
+  while ((n = ::read(fd, chunk, sizeof(chunk))) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error_ = std::string("Read failed: ") + strerror(errno);
+      return false;
+    }
+    if (!Feed(std::string_view(chunk, static_cast<size_t>(n)))) {
+      return false;
+    }
+  }
+  return Finish();
+}
+
+// Follows the nesting of [begin + scanned_, end) closely enough to find
+// where top-level forms end, and hands each to the Parser.
+bool Reader::scan(const char* begin, const char* end) {
+  const char* p = begin + scanned_;
+  auto startForm = [&](const char* at) {
+    if (depth_ == 0 && form_start_ == kNone) {
+      form_start_ = static_cast<size_t>(at - begin);
+    }
+  };
+  bool ok = true;
+  while (ok && p < end) {
+    if (state_ == State::String) {
+      p = stringEnd(p, end);
+      if (p == end) {
+        break;
+      }
+      if (*p++ == '\\') {
+        state_ = State::Escape;
+        continue;
+      }
+      state_ = State::Normal;
+      if (depth_ == 0) {
+        ok = emit(begin + form_start_, p);
+      }
+      continue;
+    }
+    if (state_ == State::Escape) {
+      ++p;
+      state_ = State::String;
+      continue;
+    }
+    if (state_ == State::Comment) {
+      p = lineEnd(p, end);
+      if (p == end) {
+        break;
+      }
+      ++p;
+      state_ = State::Normal;
+      continue;
+    }
+    if (state_ == State::Token) {
+      p = tokenEnd(p, end);
+      if (p == end) {
+        break;
+      }
+      state_ = State::Normal;
+      if (depth_ == 0) {
+        ok = emit(begin + form_start_, p);
+      }
+      continue;
+    }
+    p = skipWhitespace(p, end);
+    if (p == end) {
+      break;
+    }
+    const char c = *p;
+    const int s = signals(c);
+    if (s & 1) {
+      startForm(p);
+      state_ = State::Token;
+    } else if (c == '"') {
+      startForm(p);
+      state_ = State::String;
+    } else if (c == ';') {
+      state_ = State::Comment;
+    } else if (c == '(' || c == '[' || c == '{') {
+      startForm(p);
+      ++depth_;
+    } else if (c == ')' || c == ']' || c == '}') {
+      if (depth_ == 0) {
+        error_ = std::string("Unmatched '") + c + "'";
+        ok = false;
+      } else if (--depth_ == 0) {
+        ok = emit(begin + form_start_, p + 1);
+      }
+    } else if (s & 2 || c == '#' || c == '^' || c == '`' || c == '\'' ||
+               c == '~') {
+      // Belongs to the form that follows.
+      startForm(p);
     } else {
-      after += c;
+      error_ = "Unexpected character \\o" +
+               std::to_string(static_cast<uint8_t>(c) >> 6) +
+               std::to_string(static_cast<uint8_t>(c) >> 3 & 7) +
+               std::to_string(c & 7);
+      ok = false;
     }
+    ++p;
   }
-  return after;
+  scanned_ = static_cast<size_t>(p - begin);
+  return ok;
 }
 
+bool Reader::emit(const char* p, const char* end) {
+  form_start_ = kNone;
+  if (spans_ != nullptr) {
+    spans_->emplace_back(p, static_cast<size_t>(end - p));
+    return true;
+  }
+  Tree forms = Parser::Read(p, end, &error_);
+  if (forms == nullptr) {
+    return false;
+  }
+  if (forms->AsNodes().size() != 1) {
+    error_ = "Expected a single form";
+    return false;
+  }
+  Node* form = forms->AsNodes()[0];
+  Arena* arena = forms.get_deleter().arena;
+  forms.release();
+  on_form_(Tree(form, TreeDeleter{arena}));
+  return true;
+}
+
+namespace {
 std::string charName(const char c) {
   return
     c == '\n' ? "newline" :
@@ -608,50 +1209,374 @@ std::string charName(const char c) {
     c == '\r' ? "return" :
     std::string(1, c);
 }
+
+// The shortest text that reads back as `f', and as a float.
+std::string floatName(const double f) {
+  char buffer[32];
+  const auto r = std::to_chars(buffer, buffer + sizeof(buffer), f);
+  std::string name(buffer, r.ptr);
+  if (name.find_first_of(".en") == std::string::npos) {
+    name += ".0";
+  }
+  return name;
+}
+
+constexpr size_t kFlushSize = 1 << 16;
 } // ::
 
+Writer::Writer(std::string* out, Style style)
+    : out_(out), stream_(nullptr), style_(style) {}
+
+Writer::Writer(std::ostream* out, Style style)
+    : out_(&buffer_), stream_(out), style_(style) {}
+
+Writer::~Writer() {
+  Flush();
+}
+
+void Writer::Write(const Node& node, size_t indent) {
+  write(node, indent);
+  if (stream_ != nullptr && buffer_.size() >= kFlushSize) {
+    Flush();
+  }
+}
+
+void Writer::Flush() {
+  if (stream_ != nullptr && !buffer_.empty()) {
+    stream_->write(buffer_.data(),
+                   static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+  }
+}
+
+void Writer::write(const Node& node, size_t indent) {
+  std::string& out = *out_;
+  switch (node.type()) {
+    case Node::Type::Nil:
+      out += "nil";
+      return;
+    case Node::Type::Bool:
+      out += node.AsBool() ? "true" : "false";
+      return;
+    case Node::Type::Char:
+      out += '\\';
+      out += charName(node.AsChar());
+      return;
+    case Node::Type::Int: {
+      char buffer[24];
+      out.append(buffer,
+                 std::to_chars(buffer, buffer + sizeof(buffer), node.AsInt())
+                     .ptr);
+      return;
+    }
+    case Node::Type::Float:
+      out += floatName(node.AsFloat());
+      return;
+    case Node::Type::String:
+      writeString(node.AsString());
+      return;
+    case Node::Type::Symbol:
+      out += node.AsString();
+      return;
+    case Node::Type::Keyword:
+      out += ':';
+      out += node.AsString();
+      return;
+    default:
+      break;
+  }
+  static const char* const paren_pairs[] =
+      {"(", ")", "[", "]", "{", "}", "#{", "}"};
+  const int paren_type =
+      static_cast<int>(node.type()) - static_cast<int>(Node::Type::List);
+  out += paren_pairs[paren_type * 2];
+  const Nodes items = node.AsNodes();
+  const bool pretty = style_ == Style::Pretty;
+  for (auto it = items.cbegin(); it != items.cend(); ++it) {
+    if (it != items.cbegin()) {
+      if (node.IsMap() && pretty) {
+        out += ',';
+      }
+      if (pretty) {
+        out += '\n';
+        out.append(indent, ' ');
+      } else {
+        out += ' ';
+      }
+    }
+    write(**it, indent + 1);
+    if (node.IsMap() && it + 1 != items.cend()) {
+      ++it;
+      out += ' ';
+      write(**it, indent + 1);
+    }
+    if (stream_ != nullptr && buffer_.size() >= kFlushSize) {
+      Flush();
+    }
+  }
+  out += paren_pairs[1 + paren_type * 2];
+}
+
+void Writer::writeString(std::string_view s) {
+  std::string& out = *out_;
+  out += '"';
+  for (size_t i = 0; i < s.size();) {
+    const size_t j = s.find_first_of("\"\\", i);
+    out.append(s.substr(i, j - i));
+    if (j == std::string_view::npos) {
+      break;
+    }
+    out += '\\';
+    out += s[j];
+    i = j + 1;
+  }
+  out += '"';
+}
+
 const std::string pprint(const Node& node, size_t indent) {
-  std::string prefix(indent, ' ');
   std::string output;
-  if (node.IsCollection()) {
-    static const std::string paren_pairs[] =
-        {"(", ")", "[", "]", "{", "}", "#{", "}"};
-    const int paren_type =
-        static_cast<int>(node.type) - static_cast<int>(Node::Type::List);
-    output += paren_pairs[paren_type * 2];
-    const std::vector<Node*>& values = node.AsNodes();
-    bool first_iteration = true;
-    for (auto it = values.cbegin(); it != values.cend(); ++it) {
-      if (first_iteration) {
-        first_iteration = false;
-      } else {
-        output += (node.IsMap() ? ",\n" : "\n") + prefix;
+  Writer(&output, Writer::Style::Pretty).Write(node, indent);
+  return output;
+}
+
+// The encoding, where numbers are LEB128 varints:
+//   magic[8]             "EDENBIN" and a version byte
+//   num_names            then each name as length and bytes
+//   node                 the root, in preorder:
+//     u8 type
+//     Bool, Char:        u8
+//     Int, Float:        8 bytes, in host byte order
+//     String:            length and bytes
+//     Symbol, Keyword:   index into the names
+//     collections:       count and the items
+// Collections nest at most kMaxDepth deep, which bounds the recursion of the
+// encoder and of the decoder, whatever the input.
+namespace {
+constexpr char kMagic[8] = {'E', 'D', 'E', 'N', 'B', 'I', 'N', 2};
+constexpr size_t kMaxDepth = 1000;
+
+void putVarint(uint32_t x, std::string* out) {
+  for (; x >= 0x80; x >>= 7) {
+    *out += static_cast<char>(x | 0x80);
+  }
+  *out += static_cast<char>(x);
+}
+
+class Encoder {
+ public:
+  // Returns false if `node' nests deeper than kMaxDepth.
+  bool Encode(const Node& node, size_t depth = 0) {
+    put<uint8_t>(static_cast<uint8_t>(node.type()));
+    switch (node.type()) {
+      case Node::Type::Nil:
+        return true;
+      case Node::Type::Bool:
+        put<uint8_t>(node.AsBool() ? 1 : 0);
+        return true;
+      case Node::Type::Char:
+        put<char>(node.AsChar());
+        return true;
+      case Node::Type::Int:
+        put<int64_t>(node.AsInt());
+        return true;
+      case Node::Type::Float:
+        put<double>(node.AsFloat());
+        return true;
+      case Node::Type::String:
+        putString(node.AsString());
+        return true;
+      case Node::Type::Symbol:
+      case Node::Type::Keyword: {
+        const auto inserted = names_.emplace(
+            node.AsName(), static_cast<uint32_t>(names_.size()));
+        if (inserted.second) {
+          name_order_.push_back(node.AsName());
+        }
+        putVarint(inserted.first->second, &nodes_);
+        return true;
       }
-      output += pprint(**it, indent + 1);
-      if (node.IsMap()) {
-        ++it;
-        output += " " + pprint(**it, indent + 1);
+      default:
+        break;
+    }
+    if (depth == kMaxDepth) {
+      return false;
+    }
+    putVarint(static_cast<uint32_t>(node.AsNodes().size()), &nodes_);
+    for (const Node* item : node.AsNodes()) {
+      if (!Encode(*item, depth + 1)) {
+        return false;
       }
     }
-    output += paren_pairs[1 + paren_type * 2];
-  } else if (node.IsNil()) {
-    output = "nil";
-  } else if (node.IsBool()) {
-    output = node.As<bool>() ? "true" : "false";
-  } else if (node.IsChar()) {
-    output = "\\" + charName(node.As<char>());
-  } else if (node.IsInt()) {
-    output = std::to_string(node.As<int>());
-  } else if (node.IsFloat()) {
-    output = std::to_string(node.As<double>());
-  } else if (node.IsString()) {
-    output = "\"" + escapeQuotes(node.AsString()) + "\"";
-  } else if (node.IsSymbol()) {
-    output = node.AsString();
-  } else if (node.IsKeyword()) {
-    output = ":" + node.AsString();
+    return true;
   }
-  return output;
+
+  std::string Finish() {
+    std::string out(kMagic, sizeof(kMagic));
+    putVarint(static_cast<uint32_t>(name_order_.size()), &out);
+    for (const std::string* name : name_order_) {
+      putVarint(static_cast<uint32_t>(name->size()), &out);
+      out += *name;
+    }
+    return out + nodes_;
+  }
+
+ private:
+  template <typename T>
+  void put(T x) {
+    nodes_.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  }
+  void putString(std::string_view s) {
+    putVarint(static_cast<uint32_t>(s.size()), &nodes_);
+    nodes_ += s;
+  }
+
+  // Interned names, so keyed by address.
+  std::unordered_map<const std::string*, uint32_t> names_;
+  std::vector<const std::string*> name_order_;
+  std::string nodes_;
+};
+
+class Decoder {
+ public:
+  Decoder(const char* data, size_t size)
+      : arena_(std::make_unique<Arena>()), p_(data), end_(data + size) {}
+
+  Tree Decode() {
+    if (end_ - p_ < static_cast<ptrdiff_t>(sizeof(kMagic)) ||
+        memcmp(p_, kMagic, sizeof(kMagic)) != 0) {
+      return nullptr;
+    }
+    p_ += sizeof(kMagic);
+    uint32_t num_names;
+    if (!getVarint(&num_names)) {
+      return nullptr;
+    }
+    names_.reserve(num_names);
+    for (uint32_t i = 0; i < num_names; ++i) {
+      std::string_view name;
+      if (!getString(&name)) {
+        return nullptr;
+      }
+      names_.push_back(Intern(name));
+    }
+    Node* root = decodeNode();
+    if (root == nullptr || p_ != end_) {
+      return nullptr;
+    }
+    return Tree(root, TreeDeleter{arena_.release()});
+  }
+
+ private:
+  template <typename T>
+  bool get(T* x) {
+    if (end_ - p_ < static_cast<ptrdiff_t>(sizeof(T))) {
+      return false;
+    }
+    memcpy(x, p_, sizeof(T));
+    p_ += sizeof(T);
+    return true;
+  }
+  bool getVarint(uint32_t* x) {
+    *x = 0;
+    for (int shift = 0; shift < 35 && p_ < end_; shift += 7) {
+      const uint8_t b = static_cast<uint8_t>(*p_++);
+      if (shift == 28 && b > 0x0f) {
+        return false;  // More than 32 bits.
+      }
+      *x |= static_cast<uint32_t>(b & 0x7f) << shift;
+      if (b < 0x80) {
+        return true;
+      }
+    }
+    return false;
+  }
+  bool getString(std::string_view* s) {
+    uint32_t size;
+    if (!getVarint(&size) || static_cast<size_t>(end_ - p_) < size) {
+      return false;
+    }
+    *s = std::string_view(p_, size);
+    p_ += size;
+    return true;
+  }
+
+  Node* decodeNode(size_t depth = 0) {
+    uint8_t type_byte;
+    if (!get(&type_byte) ||
+        type_byte > static_cast<uint8_t>(Node::Type::Set)) {
+      return nullptr;
+    }
+    const auto type = static_cast<Node::Type>(type_byte);
+    switch (type) {
+      case Node::Type::Nil:
+        return arena_->New<Node>();
+      case Node::Type::Bool: {
+        uint8_t b;
+        return get(&b) ? arena_->New<Node>(Node::Bool(b != 0)) : nullptr;
+      }
+      case Node::Type::Char: {
+        char c;
+        return get(&c) ? arena_->New<Node>(Node::Char(c)) : nullptr;
+      }
+      case Node::Type::Int: {
+        int64_t i;
+        return get(&i) ? arena_->New<Node>(Node::Int(i)) : nullptr;
+      }
+      case Node::Type::Float: {
+        double f;
+        return get(&f) ? arena_->New<Node>(Node::Float(f)) : nullptr;
+      }
+      case Node::Type::String: {
+        std::string_view s;
+        if (!getString(&s)) {
+          return nullptr;
+        }
+        return arena_->New<Node>(Node::String(
+            s.size() <= Node::kInlineSize ? s : arena_->Copy(s)));
+      }
+      case Node::Type::Symbol:
+      case Node::Type::Keyword: {
+        uint32_t i;
+        if (!getVarint(&i) || i >= names_.size()) {
+          return nullptr;
+        }
+        return arena_->New<Node>(type == Node::Type::Symbol
+                                     ? Node::Symbol(names_[i])
+                                     : Node::Keyword(names_[i]));
+      }
+      default:
+        break;
+    }
+    uint32_t size;
+    // Every item takes at least a byte, which bounds `size' for a corrupt
+    // input.
+    if (depth == kMaxDepth || !getVarint(&size) ||
+        static_cast<size_t>(end_ - p_) < size) {
+      return nullptr;
+    }
+    Node** data = Node::NewItems(arena_.get(), type, size);
+    for (uint32_t i = 0; i < size; ++i) {
+      if ((data[i] = decodeNode(depth + 1)) == nullptr) {
+        return nullptr;
+      }
+    }
+    return arena_->New<Node>(Node::IndexedCollection(type, data, size));
+  }
+
+  std::unique_ptr<Arena> arena_;
+  const char* p_;
+  const char* const end_;
+  std::vector<const std::string*> names_;
+};
+} // ::
+
+std::string encode(const Node& node) {
+  Encoder encoder;
+  return encoder.Encode(node) ? encoder.Finish() : "";
+}
+
+Tree decode(const char* data, size_t size) {
+  return Decoder(data, size).Decode();
 }
 
 }  // ::eden
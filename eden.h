@@ -1,12 +1,116 @@
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <memory>
+#include <new>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace eden {
-// Maybe a small hierarchy of nodes (a base one without value/values fields),
-// with subclasses containing the actual values.
-struct Node {
-  enum class Type {
+struct Node;
+
+// Owns the nodes and payloads of a tree, carved out of a few large blocks,
+// and frees them all at once.
+class Arena {
+ public:
+  // Blocks start at `first_block' bytes and double up to kMaxBlock.  A few
+  // blocks of that size are kept from Arenas that are gone for the next ones,
+  // so reading tree after tree does not fault fresh pages in every time.
+  static constexpr size_t kMaxBlock = 1 << 20;
+  explicit Arena(size_t first_block = 8192) : block_size_(first_block) {}
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* Allocate(size_t size, size_t align) {
+    const uintptr_t next = reinterpret_cast<uintptr_t>(next_);
+    uintptr_t p = (next + align - 1) & ~(align - 1);
+    if (next_ == nullptr || p + size > reinterpret_cast<uintptr_t>(end_)) {
+      grow(size + align);
+      p = (reinterpret_cast<uintptr_t>(next_) + align - 1) & ~(align - 1);
+    }
+    next_ = reinterpret_cast<char*>(p + size);
+    return reinterpret_cast<void*>(p);
+  }
+
+  // A copy of `s' that lives as long as the Arena.
+  std::string_view Copy(std::string_view s) {
+    char* p = static_cast<char*>(Allocate(s.size(), 1));
+    s.copy(p, s.size());
+    return std::string_view(p, s.size());
+  }
+
+  // Objects with a destructor are destroyed, last first, with the Arena.
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    if constexpr (std::is_trivially_destructible<T>::value) {
+      return new (Allocate(sizeof(T), alignof(T)))
+          T(std::forward<Args>(args)...);
+    } else {
+      auto* finalizer = new (Allocate(sizeof(Finalizer), alignof(Finalizer)))
+          Finalizer{nullptr, nullptr, finalizers_};
+      T* object =
+          new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      finalizer->object = object;
+      finalizer->destroy = [](void* o) { static_cast<T*>(o)->~T(); };
+      finalizers_ = finalizer;
+      return object;
+    }
+  }
+
+ private:
+  struct Finalizer {
+    void (*destroy)(void*);
+    void* object;
+    Finalizer* next;
+  };
+
+  void grow(size_t at_least);
+
+  char* next_ = nullptr;
+  char* end_ = nullptr;
+  size_t block_size_;
+  // With their sizes.
+  std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks_;
+  Finalizer* finalizers_ = nullptr;
+};
+
+// Symbol and keyword names are interned: every occurrence of a name, in any
+// tree, points at the same string, which lives as long as the process.
+const std::string* Intern(std::string_view name);
+// The interned `name', or nullptr if nothing interned it yet.  Unlike
+// Intern(), it never adds to the table.
+const std::string* Interned(std::string_view name);
+
+// The items of a collection, in an Arena.
+class Nodes {
+ public:
+  Nodes(Node* const* data, size_t size) : data_(data), size_(size) {}
+
+  Node* const* begin() const { return data_; }
+  Node* const* end() const { return data_ + size_; }
+  Node* const* cbegin() const { return data_; }
+  Node* const* cend() const { return data_ + size_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Node* operator[](size_t i) const { return data_[i]; }
+
+ private:
+  Node* const* data_;
+  size_t size_;
+};
+
+// A tagged value in 16 bytes.  Scalars and strings of up to kInlineSize
+// bytes are stored in the node; longer strings and collection items are
+// referred to by pointer and length, and live in the tree's Arena (or, for
+// nodes made by hand, wherever the maker keeps them).
+class Node {
+ public:
+  enum class Type : uint8_t {
     // Atoms
     Nil = 0,
     Bool = 1,
@@ -22,62 +126,269 @@ struct Node {
     Map = 10,
     Set = 11,
   };
-  Type type;
-  void* value;
+  static constexpr size_t kInlineSize = 14;
+  // Maps and sets of more keys than this, as read or decoded, carry a hash
+  // index for Get() and Contains(); smaller ones are scanned.
+  static constexpr size_t kIndexedSize = 8;
+
+  Node() : Node(Type::Nil) {}
+  static Node Bool(bool b) {
+    Node node(Type::Bool);
+    node.out_.b = b;
+    return node;
+  }
+  static Node Char(char c) {
+    Node node(Type::Char);
+    node.out_.c = c;
+    return node;
+  }
+  static Node Int(int64_t i) {
+    Node node(Type::Int);
+    node.out_.i = i;
+    return node;
+  }
+  static Node Float(double f) {
+    Node node(Type::Float);
+    node.out_.f = f;
+    return node;
+  }
+  // Copies `s' into the node if it fits; otherwise `s' must outlive it.
+  static Node String(std::string_view s) {
+    Node node(Type::String);
+    if (s.size() <= kInlineSize) {
+      node.in_ = Inline{Type::String, static_cast<uint8_t>(s.size()), {}};
+      s.copy(node.in_.chars, s.size());
+    } else {
+      node.out_.size = static_cast<uint32_t>(s.size());
+      node.out_.chars = s.data();
+    }
+    return node;
+  }
+  // `name' from Intern().
+  static Node Symbol(const std::string* name) {
+    Node node(Type::Symbol);
+    node.out_.name = name;
+    return node;
+  }
+  static Node Keyword(const std::string* name) {
+    Node node(Type::Keyword);
+    node.out_.name = name;
+    return node;
+  }
+  // `type' is List, Vector, Map or Set.
+  static Node Collection(Type type, Node* const* items, size_t size) {
+    Node node(type);
+    node.out_.size = static_cast<uint32_t>(size);
+    node.out_.items = items;
+    return node;
+  }
+  // Room in `arena' for the `size' items of a collection of `type', and past
+  // them for the index of a map or set large enough to have one.
+  static Node** NewItems(Arena* arena, Type type, size_t size);
+  // Like Collection(), for items from NewItems() once they are all set.
+  // Indexes large maps and sets.
+  static Node IndexedCollection(Type type, Node** items, size_t size);
+
+  Type type() const { return in_.type; }
 
   const std::string& Typename() const {
     static const std::string typenames[] = {
         "nil", "bool", "char", "int", "float", "string", "symbol",
         "keyword", "list", "vector", "map", "set",
     };
-    return typenames[static_cast<int>(type)];
+    return typenames[static_cast<int>(type())];
   }
 
   bool IsCollection() const {
-    return static_cast<int>(type) & static_cast<int>(Node::Type::List);
+    return static_cast<int>(type()) & static_cast<int>(Node::Type::List);
   }
 
-  template <typename T>
-  const T& As() const {
-    if (value == nullptr) {
-      // Die?
-      exit(1);
+  bool AsBool() const { return out_.b; }
+  char AsChar() const { return out_.c; }
+  int64_t AsInt() const { return out_.i; }
+  double AsFloat() const { return out_.f; }
+
+  // Strings, symbols and keywords (without the ':'); empty for the rest.
+  std::string_view AsString() const {
+    if (type() == Type::Symbol || type() == Type::Keyword) {
+      return *out_.name;
+    }
+    if (type() != Type::String) {
+      return std::string_view();
     }
-    return *static_cast<const T*>(value);
+    if (in_.size != kOutOfLine) {
+      return std::string_view(in_.chars, in_.size);
+    }
+    return std::string_view(out_.chars, out_.size);
   }
+  // Symbols and keywords, interned, so they can be compared by address.
+  const std::string* AsName() const { return out_.name; }
 
-  const std::string& AsString() const {
-    return *static_cast<std::string*>(value);
-  }
+  Nodes AsNodes() const { return Nodes(out_.items, out_.size); }
 
-  std::string* AsStringMut() {
-    return static_cast<std::string*>(value);
-  }
+  // The value of `key' in a map, or nullptr.  Where a key repeats, the last
+  // one counts.  Keys compare by value; collections item by item.
+  const Node* Get(const Node& key) const;
+  // Whether a map has `key', or a set has it.
+  bool Contains(const Node& key) const;
 
-  const std::vector<Node*>& AsNodes() const {
-    return *static_cast<std::vector<Node*>*>(value);
-  }
+  bool IsNil() const { return type() == Type::Nil; }
+  bool IsBool() const { return type() == Type::Bool; }
+  bool IsChar() const { return type() == Type::Char; }
+  bool IsInt() const { return type() == Type::Int; }
+  bool IsFloat() const { return type() == Type::Float; }
+  bool IsString() const { return type() == Type::String; }
+  bool IsSymbol() const { return type() == Type::Symbol; }
+  bool IsKeyword() const { return type() == Type::Keyword; }
+  bool IsList() const { return type() == Type::List; }
+  bool IsVector() const { return type() == Type::Vector; }
+  bool IsMap() const { return type() == Type::Map; }
+  bool IsSet() const { return type() == Type::Set; }
 
-  std::vector<Node*>* AsNodesMut() {
-    return static_cast<std::vector<Node*>*>(value);
+ private:
+  static constexpr uint8_t kOutOfLine = 0xff;
+
+  explicit Node(Type type) {
+    out_.type = type;
+    out_.inline_size = kOutOfLine;
+    out_.indexed = false;
+    out_.size = 0;
+    out_.i = 0;
   }
 
-  bool IsNil() const { return type == Type::Nil; }
-  bool IsBool() const { return type == Type::Bool; }
-  bool IsChar() const { return type == Type::Char; }
-  bool IsInt() const { return type == Type::Int; }
-  bool IsFloat() const { return type == Type::Float; }
-  bool IsString() const { return type == Type::String; }
-  bool IsSymbol() const { return type == Type::Symbol; }
-  bool IsKeyword() const { return type == Type::Keyword; }
-  bool IsList() const { return type == Type::List; }
-  bool IsVector() const { return type == Type::Vector; }
-  bool IsMap() const { return type == Type::Map; }
-  bool IsSet() const { return type == Type::Set; }
+  // Both start with the type, which can be read through either.
+  struct Inline {
+    Type type;
+    uint8_t size;
+    char chars[kInlineSize];
+  };
+  struct OutOfLine {
+    Type type;
+    uint8_t inline_size;  // kOutOfLine
+    // A map or set whose items are followed by the slots of a hash index.
+    bool indexed;
+    uint32_t size;        // Of chars or items.
+    union {
+      bool b;
+      char c;
+      int64_t i;
+      double f;
+      const char* chars;
+      const std::string* name;
+      Node* const* items;
+    };
+  };
+  // The item a map's key or a set's member is at, or nullptr.
+  Node* const* find(const Node& key) const;
+
+  union {
+    Inline in_;
+    OutOfLine out_;
+  };
+};
+static_assert(sizeof(Node) == 16, "eden::Node should stay 16 bytes");
+
+// Deletes the Arena a tree was read into, and so the whole tree.
+struct TreeDeleter {
+  Arena* arena = nullptr;
+  void operator()(Node*) const { delete arena; }
+};
+typedef std::unique_ptr<Node, TreeDeleter> Tree;
+
+// The forms in `s', in a vector.  The tree does not refer to `s'.
+Tree read(std::string_view s);
+
+// Reads eden text that arrives in pieces (or from an fd), and hands over each
+// top-level form, in a Tree of its own, as soon as it is complete.  Only an
+// unfinished form is kept between pieces, so memory is bounded by the
+// largest form, not by the input.
+class Reader {
+ public:
+  typedef std::function<void(Tree)> FormHandler;
+  explicit Reader(FormHandler on_form);
+
+  // Reads the next piece of the input.  Returns false, with error() set, on a
+  // syntax error; the Reader is done then.
+  bool Feed(std::string_view chunk);
+  // Ends the input.  Returns false if it ends inside a form.
+  bool Finish();
+  // Feeds all of `fd', mmap'd if it is a regular file and read in chunks
+  // otherwise, then finishes.
+  bool ReadFd(int fd);
+
+  const std::string& error() const { return error_; }
+
+ private:
+  friend bool IndexForms(std::string_view text,
+                         std::vector<std::string_view>* forms,
+                         std::string* error);
+
+  enum class State { Normal, Token, String, Escape, Comment };
+  static constexpr size_t kNone = ~size_t{0};
+
+  bool scan(const char* begin, const char* end);
+  bool emit(const char* p, const char* end);
+
+  FormHandler on_form_;
+  // Where forms go instead, for IndexForms().
+  std::vector<std::string_view>* spans_ = nullptr;
+  // The unfinished form, if any.  Offsets below are into it, or into the
+  // piece being read if buffer_ is empty.
+  std::string buffer_;
+  size_t scanned_ = 0;
+  size_t form_start_ = kNone;
+  State state_ = State::Normal;
+  size_t depth_ = 0;
+  std::string error_;
 };
 
-std::unique_ptr<Node> read(const std::string& s);
+// Appends the top-level forms of `text' to `*forms', as slices of it, without
+// reading them: follows just enough of the syntax to find where each ends.
+// Returns false, with `*error' set, if a form is left open or a paren is
+// unmatched; what is inside the forms is only checked by read().
+bool IndexForms(std::string_view text, std::vector<std::string_view>* forms,
+                std::string* error);
+
+// Writes trees as text, into a string or a stream.  Pretty is pprint()'s
+// layout, every item on a line of its own; Compact is a single line, for
+// machine output.
+class Writer {
+ public:
+  enum class Style { Compact, Pretty };
+
+  // Appends to `*out'.
+  Writer(std::string* out, Style style);
+  // Writes to `*out' through a buffer, flushed as it fills, by Flush() and on
+  // destruction.
+  Writer(std::ostream* out, Style style);
+  ~Writer();
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+
+  // `indent' is the column of the node, for Pretty.
+  void Write(const Node& node, size_t indent = 1);
+  void Flush();
+
+ private:
+  void write(const Node& node, size_t indent);
+  void writeString(std::string_view s);
+
+  std::string* const out_;
+  std::ostream* const stream_;
+  std::string buffer_;
+  const Style style_;
+};
 
 const std::string pprint(const Node& node, size_t indent = 1);
 
+// A compact binary form of a tree, for caching parses.  It has no pointers,
+// only counts and lengths, so it can be used straight from an mmap'd file:
+// decoding is a single pass that copies it into an Arena, without
+// tokenizing, and interns each distinct name once.  Returns "" for a tree
+// whose collections nest more than 1000 deep.
+std::string encode(const Node& node);
+// The tree encoded in [data, data + size), or nullptr if that is not a
+// complete encoding of this version (or nests too deep).
+Tree decode(const char* data, size_t size);
+
 }  // ::eden